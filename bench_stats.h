@@ -0,0 +1,72 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_BENCH_STATS_H
+#define QPDFIUM_BENCH_STATS_H
+
+// Duration statistics of pdfium-backend-bench and pdfium-backend-replay
+
+#include <QJsonObject>
+#include <QMap>
+#include <QString>
+#include <QVector>
+
+#include <algorithm>
+
+#include <sys/resource.h>
+
+// Durations of one operation, in nanoseconds
+typedef QMap<QString, QVector<qint64>> Samples;
+
+inline qint64 peakRssKb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    return usage.ru_maxrss;     // kilobytes on Linux
+}
+
+inline double percentile(const QVector<qint64> &sorted, double p)
+{
+    const int index = qBound(0, int(p * (sorted.count() - 1) + 0.5), sorted.count() - 1);
+    return sorted.at(index) / 1e6;
+}
+
+inline QJsonObject summarize(const Samples &samples)
+{
+    QJsonObject result;
+    for (auto it = samples.constBegin(); it != samples.constEnd(); ++it) {
+        QVector<qint64> sorted = it.value();
+        if (sorted.isEmpty())
+            continue;
+        std::sort(sorted.begin(), sorted.end());
+        qint64 total = 0;
+        for (qint64 sample : qAsConst(sorted))
+            total += sample;
+
+        QJsonObject stats;
+        stats[QStringLiteral("count")] = sorted.count();
+        stats[QStringLiteral("min")] = sorted.first() / 1e6;
+        stats[QStringLiteral("mean")] = total / 1e6 / sorted.count();
+        stats[QStringLiteral("p50")] = percentile(sorted, 0.50);
+        stats[QStringLiteral("p90")] = percentile(sorted, 0.90);
+        stats[QStringLiteral("p99")] = percentile(sorted, 0.99);
+        stats[QStringLiteral("max")] = sorted.last() / 1e6;
+        result[it.key()] = stats;
+    }
+    return result;
+}
+
+inline void merge(Samples &into, const Samples &from)
+{
+    for (auto it = from.constBegin(); it != from.constEnd(); ++it)
+        into[it.key()] += it.value();
+}
+
+#endif // QPDFIUM_BENCH_STATS_H
@@ -0,0 +1,131 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QGlobalStatic>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QVector>
+
+#include <cstdlib>
+
+#include "bitmap_pool.h"
+
+namespace QPdfium {
+
+// Buffer sizes are rounded up to this, so tiles of about the same size share a bucket
+static const qint64 bucketGranularity = 64 * 1024;
+// Free buffers kept for reuse, in bytes
+static const qint64 maxPooledBytes = 64 * 1024 * 1024;
+
+class BitmapPool
+{
+public:
+    ~BitmapPool()
+    {
+        clear();
+    }
+
+    void *take(qint64 size)
+    {
+        {
+            QMutexLocker locker(&mutex);
+            auto it = buckets.find(size);
+            if (it != buckets.end() && !it->isEmpty()) {
+                pooledBytes -= size;
+                return it->takeLast();
+            }
+        }
+        return malloc(size_t(size));
+    }
+
+    void give(void *buffer, qint64 size)
+    {
+        QMutexLocker locker(&mutex);
+        if (pooledBytes + size > maxPooledBytes) {
+            locker.unlock();
+            free(buffer);
+            return;
+        }
+        buckets[size].append(buffer);
+        pooledBytes += size;
+    }
+
+    void clear()
+    {
+        QMutexLocker locker(&mutex);
+        for (auto it = buckets.begin(); it != buckets.end(); ++it) {
+            for (void *buffer : qAsConst(*it))
+                free(buffer);
+        }
+        buckets.clear();
+        pooledBytes = 0;
+    }
+
+    qint64 bytes()
+    {
+        QMutexLocker locker(&mutex);
+        return pooledBytes;
+    }
+
+private:
+    QMutex mutex;
+    QHash<qint64, QVector<void*>> buckets;
+    qint64 pooledBytes {0};
+};
+
+Q_GLOBAL_STATIC(BitmapPool, bitmapPool)
+
+struct PooledBuffer
+{
+    void *data;
+    qint64 size;
+};
+
+static void releaseBuffer(void *info)
+{
+    auto buffer = static_cast<PooledBuffer*>(info);
+    // Images can outlive the pool at exit
+    if (bitmapPool.exists() && !bitmapPool.isDestroyed())
+        bitmapPool->give(buffer->data, buffer->size);
+    else
+        free(buffer->data);
+    delete buffer;
+}
+
+QImage AllocateRenderImage(int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return QImage();
+
+    const int bytesPerLine = width * 4;
+    qint64 size = qint64(bytesPerLine) * height;
+    size = (size + bucketGranularity - 1) / bucketGranularity * bucketGranularity;
+
+    auto buffer = new PooledBuffer { bitmapPool->take(size), size };
+    if (!buffer->data) {
+        delete buffer;
+        return QImage();
+    }
+    return QImage(static_cast<uchar*>(buffer->data), width, height, bytesPerLine,
+                  RenderImageFormat, releaseBuffer, buffer);
+}
+
+void ReleasePooledBitmaps()
+{
+    if (bitmapPool.exists())
+        bitmapPool->clear();
+}
+
+qint64 PooledBitmapBytes()
+{
+    return bitmapPool.exists() ? bitmapPool->bytes() : 0;
+}
+
+}
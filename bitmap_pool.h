@@ -0,0 +1,33 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_BITMAP_POOL_H
+#define QPDFIUM_BITMAP_POOL_H
+
+#include <QImage>
+
+namespace QPdfium {
+
+// Pixel format of the pixmaps handed to Okular. Pages are drawn on an opaque background,
+// and QPixmap::fromImage() takes RGB32 without converting it.
+const QImage::Format RenderImageFormat = QImage::Format_RGB32;
+
+// An uninitialized RenderImageFormat image whose buffer comes from a pool of recently
+// released ones. The buffer goes back to the pool when the last copy of the image is gone.
+QImage AllocateRenderImage(int width, int height);
+
+// Drops the buffers kept for reuse
+void ReleasePooledBitmaps();
+
+// Bytes of the buffers kept for reuse
+qint64 PooledBitmapBytes();
+
+}
+
+#endif // QPDFIUM_BITMAP_POOL_H
@@ -8,49 +8,210 @@
  ***************************************************************************/
 
 #include <pdfium/fpdfview.h>
-#include <pdfium/fpdf_dataavail.h>
 #include <pdfium/fpdf_doc.h>
 #include <pdfium/fpdf_edit.h>
 #include <pdfium/fpdf_ext.h>
 #include <pdfium/fpdf_text.h>
 #include <pdfium/fpdf_sysfontinfo.h>
+#include <pdfium/fpdf_formfill.h>
 
 #include <QFile>
+#include <QHash>
+#include <QtGlobal>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QScopedPointer>
 
 #include <okular/core/document.h>
 #include <okular/core/page.h>
 
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <climits>
+#include <cstring>
+
+#include "mapped_file.h"
 #include "pdfium_utils.h"
+#include "text_cache.h"
 #include "document.h"
 #include "page.h"
+#include "trace.h"
 
 namespace QPdfium {
 
+// PDFium reads the trailer and the cross reference table from the end of the file first
+static const qint64 trailerReadAhead = 1024 * 1024;
+
+static int getBlockFromFile(void *param, unsigned long position, unsigned char *pBuf, unsigned long size);
+static int getBlockFromMap(void *param, unsigned long position, unsigned char *pBuf, unsigned long size);
+
 class DocumentPrivate
 {
 public:
     bool loadDocument(const QString &filePath, const QByteArray &password, const QSizeF &dpi)
     {
+        TraceSpan span("open document");
         this->dpi = dpi;
         this->filePath = filePath;
-        if (!pdfdoc && (pdfdoc = FPDF_LoadDocument(QFile::encodeName(filePath).constData(), password.constData()))) {
+        if (!pdfdoc && (pdfdoc = openDocument(password))) {
             unsigned long err = FPDF_GetLastError();
             locked = (err == FPDF_ERR_PASSWORD);
             pagesCount = FPDF_GetPageCount(pdfdoc);
             pageMode = static_cast<PageMode>(FPDFDoc_GetPageMode(pdfdoc));
+            if (!locked) {
+                textCache.reset(new TextCache(filePath));
+                initFormFillEnvironment();
+            }
         }
         return (pdfdoc != nullptr);
     }
 
+    // Documents are mapped, which shares the system's page cache between windows. The
+    // mapping turns into a private copy when the file gets truncated or rewritten while it
+    // is shown, see MappedFile. Where that guard isn't available, and with
+    // OKULAR_PDFIUM_MMAP=0, PDFium reads through the open handle, which only fails reads then.
+    FPDF_DOCUMENT openDocument(const QByteArray &password)
+    {
+        if (!file.isOpen()) {
+            file.setFileName(filePath);
+            if (!file.open(QIODevice::ReadOnly) || file.size() <= 0) {
+                file.close();
+                return FPDF_LoadDocument(QFile::encodeName(filePath).constData(), password.constData());
+            }
+            fileSize = file.size();
+            if (qEnvironmentVariable("OKULAR_PDFIUM_MMAP") != QLatin1String("0")) {
+                mapping.reset(MappedFile::map(file.handle(), filePath));
+                if (mapping)
+                    fileSize = mapping->size();
+            }
+#ifdef Q_OS_UNIX
+            const qint64 tail = qMax(qint64(0), fileSize - trailerReadAhead);
+            if (mapping) {
+                const qint64 pageSize = sysconf(_SC_PAGESIZE);
+                const qint64 alignedTail = tail - tail % pageSize;
+                posix_madvise(mapping->data() + alignedTail, fileSize - alignedTail, POSIX_MADV_WILLNEED);
+            }
+            else {
+                posix_fadvise(file.handle(), tail, fileSize - tail, POSIX_FADV_WILLNEED);
+            }
+#endif
+        }
+
+#ifdef Q_OS_UNIX
+        // Opening a damaged file rebuilds the cross reference table from a scan of the
+        // whole file, later reads follow the objects pages refer to
+        if (mapping)
+            posix_madvise(mapping->data(), fileSize, POSIX_MADV_SEQUENTIAL);
+#endif
+        FPDF_DOCUMENT doc = loadFromFile(password);
+#ifdef Q_OS_UNIX
+        if (mapping)
+            posix_madvise(mapping->data(), fileSize, POSIX_MADV_NORMAL);
+#endif
+        return doc;
+    }
+
+    FPDF_DOCUMENT loadFromFile(const QByteArray &password)
+    {
+        // FPDF_LoadMemDocument() reads the buffer in place, its size is an int though
+        if (mapping && fileSize <= INT_MAX)
+            return FPDF_LoadMemDocument(mapping->data(), int(fileSize), password.constData());
+
+        fileAccess.m_FileLen = static_cast<unsigned long>(fileSize);
+        fileAccess.m_GetBlock = mapping ? getBlockFromMap : getBlockFromFile;
+        fileAccess.m_Param = this;
+        return FPDF_LoadCustomDocument(&fileAccess, password.constData());
+    }
+
+    // Layered rendering draws form fields through a form fill environment, over cached
+    // page content rendered with the other annotations
+    void initFormFillEnvironment()
+    {
+        if (form || !qEnvironmentVariableIntValue("OKULAR_PDFIUM_LAYERED_RENDER"))
+            return;
+        memset(&formFillInfo, 0, sizeof(formFillInfo));
+        formFillInfo.version = 1;
+        form = FPDFDOC_InitFormFillEnvironment(pdfdoc, &formFillInfo);
+    }
+
     bool unloadDocument()
     {
+        // Pages leave the form fill environment as they close, which has to be before it goes
+        clearPageCache();
+        textCache.reset();
+        if (form) {
+            FPDFDOC_ExitFormFillEnvironment(form);
+            form = nullptr;
+        }
         if (pdfdoc) {
             FPDF_CloseDocument(pdfdoc);
             pdfdoc = nullptr;
         }
+        mapping.reset();
+        file.close();
+        fileSize = 0;
         return true;
     }
 
+    PagePtr cachedPage(int pageNumber)
+    {
+        QMutexLocker locker(&pageCacheMutex);
+
+        PagePtr page = pageCache.value(pageNumber);
+        if (page) {
+            ++pageCacheHits;
+            pageCacheLru.removeOne(pageNumber);
+            pageCacheLru.prepend(pageNumber);
+            return page;
+        }
+
+        ++pageCacheMisses;
+        page = PagePtr(new Page(pdfdoc, pageNumber, dpi, textCache.data(), form));
+        pageCache.insert(pageNumber, page);
+        pageCacheLru.prepend(pageNumber);
+        trimPageCache();
+        return page;
+    }
+
+    // Frees memory in least recently used order until the cache fits in its limits. The
+    // PDFium state of pages goes first, it can be reloaded while the extracted text and
+    // links stay; then whole pages. The most recently used pages keep everything.
+    void trimPageCache()
+    {
+        qint64 bytes = 0;
+        foreach (const PagePtr &page, pageCache)
+            bytes += page->memoryUsage();
+
+        for (int i = pageCacheLru.count() - 1; i >= pageHandlesKept && bytes > pageCacheMaxBytes; --i) {
+            const PagePtr &page = pageCache[pageCacheLru.at(i)];
+            const qint64 before = page->memoryUsage();
+            if (page->releasePdfiumState()) {
+                bytes -= before - page->memoryUsage();
+                ++pageStatesReleased;
+            }
+        }
+
+        while (pageCacheLru.count() > 1 &&
+               (pageCacheLru.count() > pageCacheMaxCount || bytes > pageCacheMaxBytes)) {
+            const int pageNumber = pageCacheLru.takeLast();
+            PagePtr page = pageCache.take(pageNumber);
+            if (page)
+                bytes -= page->memoryUsage();
+        }
+    }
+
+    void clearPageCache()
+    {
+        QMutexLocker locker(&pageCacheMutex);
+        pageCache.clear();
+        pageCacheLru.clear();
+    }
+
     QString metaText(const QByteArray &key) const
     {
         const unsigned long textLength = FPDF_GetMetaText(pdfdoc, key.constData(), nullptr, 0);
@@ -62,14 +223,49 @@ public:
 
 public:
     QString filePath;
+    QScopedPointer<TextCache> textCache;
+    QFile file;
+    QMutex fileMutex;
+    qint64 fileSize {0};
+    QScopedPointer<MappedFile> mapping;
+    FPDF_FILEACCESS fileAccess;
     FPDF_DOCUMENT pdfdoc {nullptr};
+    FPDF_FORMFILLINFO formFillInfo;
+    FPDF_FORMHANDLE form {nullptr};
     int pagesCount {-1};
     Okular::DocumentSynopsis *synopsis {nullptr};
     bool locked {false};
     PageMode pageMode {PageMode_Unknown};
     QSizeF dpi {0.0, 0.0};
+
+    QMutex pageCacheMutex;
+    QHash<int, PagePtr> pageCache;
+    QList<int> pageCacheLru;    // most recently used first
+    int pageCacheMaxCount {32};
+    qint64 pageCacheMaxBytes {128 * 1024 * 1024};
+    quint64 pageCacheHits {0};
+    quint64 pageCacheMisses {0};
+    quint64 pageStatesReleased {0};
+    // Pages that keep their PDFium state however tight the budget is
+    static const int pageHandlesKept = 4;
 };
 
+static int getBlockFromFile(void *param, unsigned long position, unsigned char *pBuf, unsigned long size)
+{
+    DocumentPrivate *d = static_cast<DocumentPrivate*>(param);
+    QMutexLocker locker(&d->fileMutex);
+    return d->file.seek(position) && d->file.read(reinterpret_cast<char*>(pBuf), size) == qint64(size);
+}
+
+static int getBlockFromMap(void *param, unsigned long position, unsigned char *pBuf, unsigned long size)
+{
+    const DocumentPrivate *d = static_cast<const DocumentPrivate*>(param);
+    if (position + qint64(size) > d->fileSize)
+        return 0;
+    memcpy(pBuf, d->mapping->data() + position, size);
+    return 1;
+}
+
 Document::Document(const QString &filePath, const QString &password, const QSizeF &dpi)
   : d(new DocumentPrivate())
 {
@@ -78,6 +274,7 @@ Document::Document(const QString &filePath, const QString &password, const QSize
 
 Document::~Document()
 {
+    d->unloadDocument();
 }
 
 FPDF_DOCUMENT Document::pdfdoc() const
@@ -97,12 +294,72 @@ bool Document::isLocked() const
 
 bool Document::unlock(const QByteArray &password)
 {
+    d->clearPageCache();
     return d->loadDocument(d->filePath, password, d->dpi);
 }
 
 PagePtr Document::page(int pageNumber) const
 {
-    return PagePtr(new Page(d->pdfdoc, pageNumber, d->dpi));
+    if (!d->pdfdoc || pageNumber < 0 || pageNumber >= d->pagesCount)
+        return PagePtr();
+    return d->cachedPage(pageNumber);
+}
+
+void Document::setPageCacheLimits(int maxPages, qint64 maxBytes)
+{
+    QMutexLocker locker(&d->pageCacheMutex);
+    d->pageCacheMaxCount = qMax(1, maxPages);
+    d->pageCacheMaxBytes = maxBytes;
+    d->trimPageCache();
+}
+
+bool Document::hasFormFillEnvironment() const
+{
+    return d->form != nullptr;
+}
+
+// Doesn't wait for pages that are being rendered, see Page::memoryUsage()
+qint64 Document::memoryUsage() const
+{
+    QMutexLocker locker(&d->pageCacheMutex);
+    qint64 bytes = 0;
+    foreach (const PagePtr &page, d->pageCache)
+        bytes += page->memoryUsage();
+    return bytes;
+}
+
+QVariantMap Document::statistics() const
+{
+    QVariantMap pageCache;
+    {
+        QMutexLocker locker(&d->pageCacheMutex);
+        const quint64 lookups = d->pageCacheHits + d->pageCacheMisses;
+        pageCache[QStringLiteral("pages")] = d->pageCache.count();
+        pageCache[QStringLiteral("hits")] = d->pageCacheHits;
+        pageCache[QStringLiteral("misses")] = d->pageCacheMisses;
+        pageCache[QStringLiteral("hitRatio")] = lookups ? double(d->pageCacheHits) / lookups : 0.0;
+        pageCache[QStringLiteral("pdfiumStatesReleased")] = d->pageStatesReleased;
+    }
+    pageCache[QStringLiteral("bytes")] = memoryUsage();
+
+    QVariantMap result;
+    result[QStringLiteral("pageCache")] = pageCache;
+    if (d->textCache) {
+        QVariantMap textCache;
+        const quint64 hits = d->textCache->hits();
+        const quint64 misses = d->textCache->misses();
+        textCache[QStringLiteral("enabled")] = d->textCache->isEnabled();
+        textCache[QStringLiteral("hits")] = hits;
+        textCache[QStringLiteral("misses")] = misses;
+        textCache[QStringLiteral("hitRatio")] = (hits + misses) ? double(hits) / (hits + misses) : 0.0;
+        result[QStringLiteral("textCache")] = textCache;
+    }
+    return result;
+}
+
+void Document::clearPageCache()
+{
+    d->clearPageCache();
 }
 
 int Document::pagesCount() const
@@ -115,6 +372,18 @@ PageMode Document::pageMode() const
     return d->pageMode;
 }
 
+QSizeF Document::pageSize(int pageNumber) const
+{
+    return QPdfium::GetPageSizeF(d->pdfdoc, pageNumber);
+}
+
+bool Document::hasPageLabels() const
+{
+    // The page labels number tree has to cover page 0, so without a label there
+    // the document has no labels at all
+    return d->pdfdoc && d->pagesCount > 0 && FPDF_GetPageLabel(d->pdfdoc, 0, nullptr, 0) > 2;
+}
+
 QString Document::metaText(const QByteArray &key) const
 {
     return d->metaText(key);
@@ -13,6 +13,7 @@
 #include <QScopedPointer>
 #include <QSharedPointer>
 #include <QDateTime>
+#include <QVariantMap>
 
 #include <okular/core/document.h>
 
@@ -33,7 +34,15 @@ public:
     bool unlock(const QByteArray &password);
     int pagesCount() const;
     PageMode pageMode() const;
+    bool hasPageLabels() const;
+    bool hasFormFillEnvironment() const;
+    QSizeF pageSize(int pageNumber) const;
     PagePtr page(int pageNumber) const;
+    void setPageCacheLimits(int maxPages, qint64 maxBytes);
+    void clearPageCache();
+    qint64 memoryUsage() const;
+    // Page cache and text cache counters, for PDFiumGenerator::metaData("PDFiumStats")
+    QVariantMap statistics() const;
     QString metaText(const QByteArray &key) const;
     static Document *load(const QString &filePath, const QString &password = QString(), const QSizeF &dpi = {0.0, 0.0});
 
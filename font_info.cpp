@@ -0,0 +1,452 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QByteArray>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGlobalStatic>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSet>
+#include <QVector>
+#include <QtEndian>
+#include <QtGlobal>
+
+#include <cctype>
+#include <climits>
+#include <cstring>
+
+#ifdef HAVE_FONTCONFIG
+#include <fontconfig/fontconfig.h>
+#endif
+
+#include "font_info.h"
+
+namespace QPdfium {
+
+#ifdef HAVE_FONTCONFIG
+
+static const quint32 ttcfTag = 0x74746366;     // 'ttcf'
+
+struct FontFace
+{
+    QByteArray family;
+    QString file;
+    int index {0};
+    int weight {400};
+    bool italic {false};
+    bool fixedPitch {false};
+    int charset {FXFONT_ANSI_CHARSET};
+
+    // Read on first use, shared by all documents. Not mapped: a font package update
+    // truncating the file would crash the process with SIGBUS.
+    QByteArray contents;
+    bool readFailed {false};
+    const uchar *data {nullptr};
+    qint64 size {0};
+};
+
+// Lower case without spaces and punctuation, "Times New Roman,Bold" -> "timesnewromanbold"
+static QByteArray normalizedName(const char *name)
+{
+    QByteArray result;
+    for (const char *c = name; c && *c; ++c) {
+        if (isalnum(static_cast<uchar>(*c)))
+            result.append(char(tolower(static_cast<uchar>(*c))));
+    }
+    return result;
+}
+
+// fontconfig weights to the CSS scale PDFium uses
+static int cssWeight(int fcWeight)
+{
+    if (fcWeight <= FC_WEIGHT_LIGHT)    return 300;
+    if (fcWeight <= FC_WEIGHT_REGULAR)  return 400;
+    if (fcWeight <= FC_WEIGHT_MEDIUM)   return 500;
+    if (fcWeight <= FC_WEIGHT_DEMIBOLD) return 600;
+    if (fcWeight <= FC_WEIGHT_BOLD)     return 700;
+    return 900;
+}
+
+static int fcWeight(int cssWeight)
+{
+    if (cssWeight <= 300) return FC_WEIGHT_LIGHT;
+    if (cssWeight <= 400) return FC_WEIGHT_REGULAR;
+    if (cssWeight <= 500) return FC_WEIGHT_MEDIUM;
+    if (cssWeight <= 600) return FC_WEIGHT_DEMIBOLD;
+    if (cssWeight <= 700) return FC_WEIGHT_BOLD;
+    return FC_WEIGHT_BLACK;
+}
+
+static const char *charsetLanguage(int charset)
+{
+    switch (charset) {
+    case FXFONT_SHIFTJIS_CHARSET:    return "ja";
+    case FXFONT_HANGEUL_CHARSET:     return "ko";
+    case FXFONT_GB2312_CHARSET:      return "zh-cn";
+    case FXFONT_CHINESEBIG5_CHARSET: return "zh-tw";
+    default:                         return nullptr;
+    }
+}
+
+class FontIndex
+{
+public:
+    FontIndex()
+    {
+        QElapsedTimer timer;
+        timer.start();
+        build();
+        qDebug() << "QPdfium::FontIndex:" << faces.count() << "faces indexed in" << timer.elapsed() << "ms";
+    }
+
+    ~FontIndex()
+    {
+        qDeleteAll(faces);
+    }
+
+    FontFace *map(int weight, bool italic, int charset, int pitchFamily, const char *name, bool *exact)
+    {
+        const QByteArray key = QByteArray(name) + '|' + QByteArray::number(weight) + '|'
+                             + (italic ? '1' : '0') + '|' + QByteArray::number(charset) + '|'
+                             + QByteArray::number(pitchFamily);
+        QMutexLocker locker(&mutex);
+
+        auto it = mapped.constFind(key);
+        if (it != mapped.constEnd()) {
+            *exact = it->second;
+            return it->first;
+        }
+
+        FontFace *face = findByName(normalizedName(name), weight, italic);
+        *exact = face != nullptr;
+        if (!face)
+            face = match(weight, italic, charset, pitchFamily, name);
+        mapped.insert(key, qMakePair(face, *exact));
+        return face;
+    }
+
+    FontFace *find(const char *name)
+    {
+        QMutexLocker locker(&mutex);
+        return findByName(normalizedName(name), 400, false);
+    }
+
+    void enumerate(FPDF_SYSFONTINFO *pThis, void *mapper)
+    {
+        Q_UNUSED(pThis)
+        QMutexLocker locker(&mutex);
+        QSet<QByteArray> added;
+        for (const FontFace *face : qAsConst(faces)) {
+            if (added.contains(face->family))
+                continue;
+            added.insert(face->family);
+            FPDF_AddInstalledFont(mapper, face->family.constData(), face->charset);
+        }
+    }
+
+    unsigned long fontData(FontFace *face, unsigned int table, unsigned char *buffer, unsigned long bufferSize)
+    {
+        QMutexLocker locker(&mutex);
+        if (!face->data && !readFile(face))
+            return 0;
+
+        const bool collection = face->size >= 4 && qFromBigEndian<quint32>(face->data) == ttcfTag;
+        const uchar *start = nullptr;
+        qint64 length = 0;
+
+        if (table == 0 || table == ttcfTag) {
+            // The whole file, which is what PDFium expects for collections when it asks for 'ttcf'
+            if (collection == (table == ttcfTag)) {
+                start = face->data;
+                length = face->size;
+            }
+        }
+        else {
+            qint64 faceOffset = 0;
+            if (collection) {
+                const qint64 entry = 12 + 4 * qint64(face->index);
+                if (entry + 4 > face->size)
+                    return 0;
+                faceOffset = qFromBigEndian<quint32>(face->data + entry);
+            }
+            if (faceOffset + 12 > face->size)
+                return 0;
+            const int tableCount = qFromBigEndian<quint16>(face->data + faceOffset + 4);
+            for (int i = 0; i < tableCount; ++i) {
+                const qint64 record = faceOffset + 12 + 16 * qint64(i);
+                if (record + 16 > face->size)
+                    break;
+                if (qFromBigEndian<quint32>(face->data + record) != table)
+                    continue;
+                const qint64 offset = qFromBigEndian<quint32>(face->data + record + 8);
+                const qint64 tableLength = qFromBigEndian<quint32>(face->data + record + 12);
+                if (offset + tableLength <= face->size) {
+                    start = face->data + offset;
+                    length = tableLength;
+                }
+                break;
+            }
+        }
+
+        if (!start)
+            return 0;
+        if (buffer && bufferSize >= static_cast<unsigned long>(length))
+            memcpy(buffer, start, size_t(length));
+        return static_cast<unsigned long>(length);
+    }
+
+private:
+    void build()
+    {
+        FcPattern *pattern = FcPatternCreate();
+        FcPatternAddBool(pattern, FC_SCALABLE, FcTrue);
+        FcObjectSet *objects = FcObjectSetBuild(FC_FAMILY, FC_FULLNAME, FC_POSTSCRIPT_NAME, FC_WEIGHT, FC_SLANT,
+                                                FC_SPACING, FC_FILE, FC_INDEX, FC_LANG, nullptr);
+        FcFontSet *fontSet = FcFontList(nullptr, pattern, objects);
+        FcObjectSetDestroy(objects);
+        FcPatternDestroy(pattern);
+        if (!fontSet)
+            return;
+
+        for (int i = 0; i < fontSet->nfont; ++i)
+            addFace(fontSet->fonts[i]);
+        FcFontSetDestroy(fontSet);
+    }
+
+    FontFace *addFace(FcPattern *font)
+    {
+        FcChar8 *file = nullptr;
+        FcChar8 *family = nullptr;
+        if (FcPatternGetString(font, FC_FILE, 0, &file) != FcResultMatch ||
+            FcPatternGetString(font, FC_FAMILY, 0, &family) != FcResultMatch)
+            return nullptr;
+
+        int index = 0, weight = FC_WEIGHT_REGULAR, slant = FC_SLANT_ROMAN, spacing = FC_PROPORTIONAL;
+        FcPatternGetInteger(font, FC_INDEX, 0, &index);
+        FcPatternGetInteger(font, FC_WEIGHT, 0, &weight);
+        FcPatternGetInteger(font, FC_SLANT, 0, &slant);
+        FcPatternGetInteger(font, FC_SPACING, 0, &spacing);
+
+        const QString filePath = QFile::decodeName(reinterpret_cast<const char*>(file));
+        const QString faceKey = filePath + QLatin1Char(':') + QString::number(index);
+        if (FontFace *existing = facesByFile.value(faceKey))
+            return existing;
+
+        FontFace *face = new FontFace;
+        face->family = reinterpret_cast<const char*>(family);
+        face->file = filePath;
+        face->index = index;
+        face->weight = cssWeight(weight);
+        face->italic = slant != FC_SLANT_ROMAN;
+        face->fixedPitch = spacing == FC_MONO;
+
+        FcLangSet *langs = nullptr;
+        if (FcPatternGetLangSet(font, FC_LANG, 0, &langs) == FcResultMatch) {
+            for (int charset : { FXFONT_SHIFTJIS_CHARSET, FXFONT_GB2312_CHARSET,
+                                 FXFONT_CHINESEBIG5_CHARSET, FXFONT_HANGEUL_CHARSET }) {
+                const FcChar8 *lang = reinterpret_cast<const FcChar8*>(charsetLanguage(charset));
+                if (FcLangSetHasLang(langs, lang) == FcLangEqual) {
+                    face->charset = charset;
+                    break;
+                }
+            }
+        }
+
+        faces.append(face);
+        facesByFile.insert(faceKey, face);
+        names.insert(normalizedName(face->family.constData()), face);
+
+        // Full and PostScript names identify one face, PDFs often use them
+        FcChar8 *name = nullptr;
+        for (int i = 0; FcPatternGetString(font, FC_FULLNAME, i, &name) == FcResultMatch; ++i)
+            names.insert(normalizedName(reinterpret_cast<const char*>(name)), face);
+        if (FcPatternGetString(font, FC_POSTSCRIPT_NAME, 0, &name) == FcResultMatch)
+            names.insert(normalizedName(reinterpret_cast<const char*>(name)), face);
+        return face;
+    }
+
+    // The face of name closest to weight and italic, also trying name without a style suffix
+    FontFace *findByName(const QByteArray &name, int weight, bool italic)
+    {
+        QList<FontFace*> candidates = names.values(name);
+        if (candidates.isEmpty()) {
+            static const char *const suffixes[] = { "bolditalic", "boldoblique", "bold", "italic", "oblique",
+                                                    "regular", "psmt", "mt", "ps" };
+            QByteArray base = name;
+            for (const char *suffix : suffixes) {
+                if (base.endsWith(suffix) && base.size() > int(strlen(suffix))) {
+                    base.chop(int(strlen(suffix)));
+                    candidates = names.values(base);
+                    if (!candidates.isEmpty())
+                        break;
+                }
+            }
+            if (name.contains("bold"))
+                weight = qMax(weight, 700);
+            if (name.contains("italic") || name.contains("oblique"))
+                italic = true;
+        }
+
+        FontFace *best = nullptr;
+        int bestScore = INT_MAX;
+        for (FontFace *face : qAsConst(candidates)) {
+            const int score = qAbs(face->weight - weight) + (face->italic != italic ? 1000 : 0);
+            if (score < bestScore) {
+                best = face;
+                bestScore = score;
+            }
+        }
+        return best;
+    }
+
+    // Asks fontconfig, which knows about aliases and substitutes
+    FontFace *match(int weight, bool italic, int charset, int pitchFamily, const char *name)
+    {
+        FcPattern *pattern = FcPatternCreate();
+        QByteArray family(name);
+        const int comma = family.indexOf(',');
+        if (comma > 0)
+            family.truncate(comma);
+        if (!family.isEmpty())
+            FcPatternAddString(pattern, FC_FAMILY, reinterpret_cast<const FcChar8*>(family.constData()));
+        if (pitchFamily & FXFONT_FF_FIXEDPITCH)
+            FcPatternAddString(pattern, FC_FAMILY, reinterpret_cast<const FcChar8*>("monospace"));
+        else if (pitchFamily & FXFONT_FF_ROMAN)
+            FcPatternAddString(pattern, FC_FAMILY, reinterpret_cast<const FcChar8*>("serif"));
+        FcPatternAddInteger(pattern, FC_WEIGHT, fcWeight(weight));
+        FcPatternAddInteger(pattern, FC_SLANT, italic ? FC_SLANT_ITALIC : FC_SLANT_ROMAN);
+        FcPatternAddBool(pattern, FC_SCALABLE, FcTrue);
+        if (const char *lang = charsetLanguage(charset))
+            FcPatternAddString(pattern, FC_LANG, reinterpret_cast<const FcChar8*>(lang));
+
+        FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+        FcDefaultSubstitute(pattern);
+        FcResult result;
+        FcPattern *font = FcFontMatch(nullptr, pattern, &result);
+        FcPatternDestroy(pattern);
+        if (!font)
+            return nullptr;
+
+        FontFace *face = addFace(font);
+        FcPatternDestroy(font);
+        return face;
+    }
+
+    bool readFile(FontFace *face)
+    {
+        if (face->readFailed)
+            return false;
+        QFile file(face->file);
+        if (file.open(QIODevice::ReadOnly))
+            face->contents = file.readAll();
+        if (face->contents.isEmpty()) {
+            face->readFailed = true;
+            return false;
+        }
+        face->data = reinterpret_cast<const uchar*>(face->contents.constData());
+        face->size = face->contents.size();
+        return true;
+    }
+
+private:
+    QMutex mutex;
+    QVector<FontFace*> faces;
+    QHash<QString, FontFace*> facesByFile;
+    QMultiHash<QByteArray, FontFace*> names;
+    QHash<QByteArray, QPair<FontFace*, bool>> mapped;
+};
+
+Q_GLOBAL_STATIC(FontIndex, fontIndex)
+
+static void fontInfoRelease(FPDF_SYSFONTINFO *)
+{
+    // The index lives for the whole process
+}
+
+static void fontInfoEnumFonts(FPDF_SYSFONTINFO *pThis, void *pMapper)
+{
+    fontIndex->enumerate(pThis, pMapper);
+}
+
+static void *fontInfoMapFont(FPDF_SYSFONTINFO *, int weight, FPDF_BOOL bItalic, int charset, int pitch_family,
+                             const char *face, FPDF_BOOL *bExact)
+{
+    bool exact = false;
+    FontFace *result = fontIndex->map(weight, bItalic, charset, pitch_family, face, &exact);
+    if (bExact)
+        *bExact = exact;
+    return result;
+}
+
+static void *fontInfoGetFont(FPDF_SYSFONTINFO *, const char *face)
+{
+    return fontIndex->find(face);
+}
+
+static unsigned long fontInfoGetFontData(FPDF_SYSFONTINFO *, void *hFont, unsigned int table,
+                                         unsigned char *buffer, unsigned long buf_size)
+{
+    if (!hFont)
+        return 0;
+    return fontIndex->fontData(static_cast<FontFace*>(hFont), table, buffer, buf_size);
+}
+
+static unsigned long fontInfoGetFaceName(FPDF_SYSFONTINFO *, void *hFont, char *buffer, unsigned long buf_size)
+{
+    if (!hFont)
+        return 0;
+    const QByteArray &family = static_cast<FontFace*>(hFont)->family;
+    const unsigned long length = static_cast<unsigned long>(family.size()) + 1;
+    if (buffer && buf_size >= length)
+        memcpy(buffer, family.constData(), length);
+    return length;
+}
+
+static int fontInfoGetFontCharset(FPDF_SYSFONTINFO *, void *hFont)
+{
+    return hFont ? static_cast<FontFace*>(hFont)->charset : FXFONT_ANSI_CHARSET;
+}
+
+static void fontInfoDeleteFont(FPDF_SYSFONTINFO *, void *)
+{
+    // Faces belong to the index, their data is shared between documents
+}
+
+FPDF_SYSFONTINFO *SystemFontInfo()
+{
+    if (qgetenv("OKULAR_PDFIUM_SYSTEM_FONTS") == "0")
+        return nullptr;
+
+    static FPDF_SYSFONTINFO info = {
+        1,
+        fontInfoRelease,
+        fontInfoEnumFonts,
+        fontInfoMapFont,
+        fontInfoGetFont,
+        fontInfoGetFontData,
+        fontInfoGetFaceName,
+        fontInfoGetFontCharset,
+        fontInfoDeleteFont
+    };
+    return &info;
+}
+
+#else
+
+FPDF_SYSFONTINFO *SystemFontInfo()
+{
+    return nullptr;
+}
+
+#endif
+
+}
@@ -0,0 +1,30 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_FONT_INFO_H
+#define QPDFIUM_FONT_INFO_H
+
+#include <pdfium/fpdf_sysfontinfo.h>
+
+namespace QPdfium {
+
+/*
+ * System font lookup for PDFium, backed by an index of the fontconfig fonts
+ * that is built once per process. Names resolve through the index, other
+ * requests through fontconfig's matching, and both are memoized. Font files
+ * are read once and shared by every document.
+ *
+ * Returns nullptr without fontconfig or with OKULAR_PDFIUM_SYSTEM_FONTS=0,
+ * PDFium then scans the font directories itself.
+ */
+FPDF_SYSFONTINFO *SystemFontInfo();
+
+}
+
+#endif // QPDFIUM_FONT_INFO_H
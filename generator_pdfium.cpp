@@ -20,21 +20,146 @@
 #include <QLocale>
 #include <QDateTime>
 #include <QImage>
+#include <QElapsedTimer>
 #include <QTimer>
 #include <QMutexLocker>
+#include <QWaitCondition>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
 
 #include <okular/core/action.h>
 #include <okular/core/page.h>
+#ifdef HAVE_OKULAR_SETTINGS_CORE
+#include <okular/core/settings_core.h>
+#endif
 
 #include "pdfium_utils.h"
 #include "document.h"
 #include "page.h"
+#include "bitmap_pool.h"
+#include "font_info.h"
+#include "prefetcher.h"
+#include "render_cache.h"
+#include "render_service.h"
+#include "render_worker.h"
+#include "request_recorder.h"
+#include "trace.h"
 #include "generator_pdfium.h"
 
 OKULAR_EXPORT_PLUGIN(PDFiumGenerator, "libokularGenerator_pdfium.json")
 
 static QMutex pdfiumMutex;
 static int libraryRefCount;
+// Documents open in all generators, the bitmap pool is shared by them
+static int openDocumentCount;
+
+// Whole page requests no larger than this are thumbnails, e.g. from the sidebar
+static const int thumbnailMaxSize = 256;
+
+// Requests cancelled within this many ms mean the view is moving, see image()
+static const qint64 draftWindow = 300;
+// Drafts are rendered at this fraction of the requested size
+static const qreal draftScale = 0.5;
+
+// Tiles are rendered as part of larger regions aligned to this grid, in pixels, see image()
+static const int tileRegionGrid = 1024;
+// A region is at most this many times the area of its tile, or the tile is rendered alone
+static const int tileRegionMaxTiles = 4;
+
+// Text requests wait at most this many ms for the renders in progress, see textPage()
+static const qint64 textRenderWaitMax = 500;
+
+// The region the tile at rect is rendered in, pageSize is the size of the whole page
+static QRect tileRegion(const QRect &rect, const QSize &pageSize)
+{
+    const QPoint topLeft(rect.left() / tileRegionGrid * tileRegionGrid,
+                         rect.top() / tileRegionGrid * tileRegionGrid);
+    const QPoint bottomRight((rect.right() / tileRegionGrid + 1) * tileRegionGrid - 1,
+                             (rect.bottom() / tileRegionGrid + 1) * tileRegionGrid - 1);
+    const QRect region = QRect(topLeft, bottomRight).intersected(QRect(QPoint(0, 0), pageSize));
+    const qint64 maxPixels = qint64(rect.width()) * rect.height() * tileRegionMaxTiles;
+    if (!region.contains(rect) || qint64(region.width()) * region.height() > maxPixels)
+        return rect;
+    return region;
+}
+
+// Okular's memory levels, in the order of Okular::SettingsCore::EnumMemoryLevel
+enum MemoryLevel { LowMemory, NormalMemory, AggressiveMemory, GreedyMemory };
+
+static int currentMemoryLevel()
+{
+#ifdef HAVE_OKULAR_SETTINGS_CORE
+    return Okular::SettingsCore::memoryLevel();
+#else
+    return NormalMemory;
+#endif
+}
+
+// What the caches of a document may hold at a memory level
+struct MemoryBudget
+{
+    int pages;              // pages in the document's page cache
+    qint64 pageBytes;       // PDFium state and text of those pages
+    qint64 pixmapBytes;     // render cache
+    qint64 prefetchBytes;   // pixmaps rendered ahead
+};
+
+static MemoryBudget memoryBudget(int level)
+{
+    const qint64 MB = 1024 * 1024;
+    switch (level) {
+    case LowMemory:         return { 8, 32 * MB, 32 * MB, 0 };
+    case AggressiveMemory:  return { 64, 256 * MB, 256 * MB, 128 * MB };
+    case GreedyMemory:      return { 128, 512 * MB, 512 * MB, 256 * MB };
+    default:                return { 32, 128 * MB, 128 * MB, 64 * MB };
+    }
+}
+
+// Size of okularPage as Okular asks for its pixmaps, which are unrotated
+static QSizeF unrotatedSize(const Okular::Page *okularPage)
+{
+    if (okularPage->rotation() % 2)
+        return QSizeF(okularPage->height(), okularPage->width());
+    return QSizeF(okularPage->width(), okularPage->height());
+}
+
+// Dpi at which the page of okularPage renders to width x height pixels
+static QSizeF renderDpi(const Okular::Page *okularPage, int width, int height, const QSizeF &dpi)
+{
+    const QSizeF pageSize = unrotatedSize(okularPage);
+    return QSizeF(width / pageSize.width() * dpi.width(), height / pageSize.height() * dpi.height());
+}
+
+static int renderFlags(QPdfium::RenderTier tier)
+{
+    static const int thumbnailGrayscale =
+            qEnvironmentVariableIntValue("OKULAR_PDFIUM_THUMBNAIL_GRAYSCALE") ? FPDF_GRAYSCALE : 0;
+    const int flags = QPdfium::RenderFlagsForTier(tier);
+    return tier == QPdfium::ThumbnailTier ? flags | thumbnailGrayscale : flags;
+}
+
+// Counters behind metaData("PDFiumStats"), updated by the generator thread and read by the GUI
+struct GeneratorStats
+{
+    QAtomicInteger<quint64> pixmapRequests;
+    QAtomicInteger<quint64> abortedRequests;
+    QAtomicInteger<quint64> textRequests;
+    QAtomicInteger<quint64> workerRenders;
+    QAtomicInteger<quint64> embeddedThumbnails;
+    QAtomicInteger<quint64> renders[3];         // by QPdfium::RenderTier
+    QAtomicInteger<qint64> renderNsecs[3];
+    QAtomicInteger<qint64> userMutexWaitNsecs;
+
+    void countRender(QPdfium::RenderTier tier, qint64 nsecs)
+    {
+        ++renders[tier];
+        renderNsecs[tier].fetchAndAddRelaxed(nsecs);
+    }
+};
+
+// How often OKULAR_PDFIUM_STATS is rewritten while a document is open
+static const int statsInterval = 10000;
 
 class PDFiumGeneratorPrivate : public QSharedData
 {
@@ -47,9 +172,156 @@ public:
     PDFiumGenerator *q;
     Okular::Page* *pagesVector {nullptr};
     QPdfium::Document *doc {nullptr};
-    int pagesCount {-1};
     Okular::DocumentSynopsis *synopsis {nullptr};
     QBitArray rectsGenerated;
+    QPdfium::RenderCache renderCache;
+    QPdfium::RenderWorkerPool workerPool;
+    QPdfium::Prefetcher *prefetcher {nullptr};
+    QPdfium::RequestRecorder *recorder {nullptr};
+    int memoryLevel {-1};
+
+    // Text extraction waits for the renders in progress, see textPage()
+    QMutex renderStateMutex;
+    QWaitCondition rendersDone;
+    int pendingRenders {0};
+
+    // Restarted whenever Okular cancels a pixmap request, only used in the generator thread
+    QElapsedTimer lastAbortTimer;
+
+    GeneratorStats stats;
+    QTimer *statsTimer {nullptr};
+
+public:
+    // Sizes the caches for Okular's memory level, when it changed since the last call.
+    // Budgets set through the environment are left alone. Trimming the page cache closes
+    // pages, so call it with the user mutex and the render service held.
+    void applyMemoryLevel()
+    {
+        const int level = currentMemoryLevel();
+        if (level == memoryLevel || !doc)
+            return;
+        memoryLevel = level;
+
+        const MemoryBudget budget = memoryBudget(level);
+        doc->setPageCacheLimits(budget.pages, budget.pageBytes);
+        if (!qEnvironmentVariableIsSet("OKULAR_PDFIUM_RENDER_CACHE_MB"))
+            renderCache.setMaxBytes(budget.pixmapBytes);
+        if (prefetcher && !qEnvironmentVariableIsSet("OKULAR_PDFIUM_PREFETCH_MB"))
+            prefetcher->setMaxPixmapBytes(budget.prefetchBytes);
+    }
+
+    // Queues the pages around the one of request for the prefetcher, with pixmaps at the
+    // zoom of the request
+    void schedulePrefetch(Okular::PixmapRequest *request, QPdfium::RenderTier tier, const QSizeF &dpi)
+    {
+        if (!prefetcher || tier != QPdfium::FullTier)
+            return;
+
+        const int count = QPdfium::Prefetcher::configuredPageCount();
+        const int pagesCount = doc->pagesCount();
+        const double zoom = request->width() / unrotatedSize(request->page()).width();
+        QList<QPdfium::PrefetchJob> jobs;
+        for (int distance = 1; distance <= count; ++distance) {
+            for (int pageNumber : { request->pageNumber() + distance, request->pageNumber() - distance }) {
+                if (pageNumber < 0 || pageNumber >= pagesCount)
+                    continue;
+
+                QPdfium::PrefetchJob job;
+                job.pageNumber = pageNumber;
+                // Tiles depend on the viewport, only whole pages are worth rendering ahead.
+                // Okular truncates the zoomed size, so should the guess.
+                if (!request->isTile()) {
+                    const Okular::Page *neighbour = pagesVector[pageNumber];
+                    const QSizeF size = unrotatedSize(neighbour);
+                    const int width = int(size.width() * zoom);
+                    const int height = int(size.height() * zoom);
+                    const QSizeF neighbourDpi = renderDpi(neighbour, width, height, dpi);
+                    job.pixmapKey.pageNumber = pageNumber;
+                    job.pixmapKey.dpiX = neighbourDpi.width();
+                    job.pixmapKey.dpiY = neighbourDpi.height();
+                    job.pixmapKey.rect = QRect(0, 0, width, height);
+                    job.pixmapKey.flags = renderFlags(tier);
+                }
+                jobs.append(job);
+            }
+        }
+        prefetcher->schedule(jobs);
+    }
+
+    bool viewportMoving() const
+    {
+        return lastAbortTimer.isValid() && lastAbortTimer.elapsed() < draftWindow;
+    }
+
+    // Doesn't take the user mutex, so it answers while a render is running
+    QVariantMap statistics() const
+    {
+        QVariantMap result = doc ? doc->statistics() : QVariantMap();
+
+        // Shared by every document open in the process
+        const QPdfium::PageCounters counters = QPdfium::Page::counters();
+        QVariantMap pages;
+        pages[QStringLiteral("loaded")] = counters.pagesLoaded;
+        pages[QStringLiteral("closed")] = counters.pagesClosed;
+        pages[QStringLiteral("textPagesLoaded")] = counters.textPagesLoaded;
+        pages[QStringLiteral("textPagesClosed")] = counters.textPagesClosed;
+        pages[QStringLiteral("textLayoutsExtracted")] = counters.textLayoutsExtracted;
+        pages[QStringLiteral("linkListsExtracted")] = counters.linkListsExtracted;
+        QVariantMap process;
+        process[QStringLiteral("pdfiumPages")] = pages;
+        process[QStringLiteral("pooledBitmapBytes")] = QPdfium::PooledBitmapBytes();
+        process[QStringLiteral("renderServiceYields")] = QPdfium::RenderService::instance()->yields();
+        result[QStringLiteral("process")] = process;
+
+        static const char *const tierNames[] = { "full", "draft", "thumbnail" };
+        QVariantMap renders;
+        for (int tier = QPdfium::FullTier; tier <= QPdfium::ThumbnailTier; ++tier) {
+            QVariantMap tierStats;
+            tierStats[QStringLiteral("count")] = stats.renders[tier].loadAcquire();
+            tierStats[QStringLiteral("totalMs")] = stats.renderNsecs[tier].loadAcquire() / 1e6;
+            renders[QLatin1String(tierNames[tier])] = tierStats;
+        }
+        result[QStringLiteral("renders")] = renders;
+
+        QVariantMap requests;
+        requests[QStringLiteral("pixmaps")] = stats.pixmapRequests.loadAcquire();
+        requests[QStringLiteral("aborted")] = stats.abortedRequests.loadAcquire();
+        requests[QStringLiteral("texts")] = stats.textRequests.loadAcquire();
+        requests[QStringLiteral("workerRenders")] = stats.workerRenders.loadAcquire();
+        requests[QStringLiteral("embeddedThumbnails")] = stats.embeddedThumbnails.loadAcquire();
+        result[QStringLiteral("requests")] = requests;
+
+        const quint64 hits = renderCache.hits();
+        const quint64 misses = renderCache.misses();
+        QVariantMap pixmaps;
+        pixmaps[QStringLiteral("hits")] = hits;
+        pixmaps[QStringLiteral("misses")] = misses;
+        pixmaps[QStringLiteral("hitRatio")] = (hits + misses) ? double(hits) / (hits + misses) : 0.0;
+        pixmaps[QStringLiteral("evictions")] = renderCache.evictions();
+        pixmaps[QStringLiteral("bytes")] = renderCache.bytes();
+        pixmaps[QStringLiteral("maxBytes")] = renderCache.maxBytes();
+        result[QStringLiteral("renderCache")] = pixmaps;
+
+        if (prefetcher) {
+            QVariantMap prefetched;
+            prefetched[QStringLiteral("pages")] = prefetcher->pagesPrefetched();
+            prefetched[QStringLiteral("pixmaps")] = prefetcher->pixmapsPrefetched();
+            result[QStringLiteral("prefetcher")] = prefetched;
+        }
+
+        result[QStringLiteral("userMutexWaitMs")] = stats.userMutexWaitNsecs.loadAcquire() / 1e6;
+        return result;
+    }
+
+    // Rewrites the file OKULAR_PDFIUM_STATS names with the current statistics
+    void writeStatistics() const
+    {
+        QJsonObject json = QJsonObject::fromVariantMap(statistics());
+        json[QStringLiteral("time")] = QDateTime::currentDateTime().toString(Qt::ISODate);
+        QFile file(QFile::decodeName(qgetenv("OKULAR_PDFIUM_STATS")));
+        if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            file.write(QJsonDocument(json).toJson());
+    }
 
 public:
     bool fillDocumentViewport(FPDF_DEST destination, Okular::DocumentViewport *viewport)
@@ -80,6 +352,18 @@ public:
         return result;
     }
 
+    // Sets the link rects of a page the first time it's seen, this only needs the page
+    // loaded, not its text
+    void generateObjectRects(int pageNumber, const QPdfium::PagePtr &page, Okular::Page *okularPage)
+    {
+        if (rectsGenerated.at(pageNumber))
+            return;
+        if (page->hasLinks()) {
+            okularPage->setObjectRects(page->links());
+        }
+        rectsGenerated[pageNumber] = true;
+    }
+
     void recurseCreateTOC(QDomDocument &mainDoc, 
                           FPDF_BOOKMARK parentBookmark,
                           QDomNode &parentDestination)
@@ -102,14 +386,15 @@ public:
         }
     }
     
-    Okular::Page *newOkularPage(int pageNumber, Okular::Rotation orientation, const QSizeF &dpi)
+    Okular::Page *newOkularPage(int pageNumber, Okular::Rotation orientation, const QSizeF &dpi, bool withLabel = true)
     {
-        auto pageSize = QPdfium::GetPageSizeF(doc->pdfdoc(), pageNumber);
+        auto pageSize = doc->pageSize(pageNumber);
         pageSize.setWidth(pageSize.width() / 72.0 * dpi.width());
         pageSize.setHeight(pageSize.height() / 72.0 * dpi.height());
 
         Okular::Page* newPage = new Okular::Page(pageNumber, pageSize.width(), pageSize.height(), orientation);
-        newPage->setLabel(QPdfium::GetPageLabel(doc->pdfdoc(), pageNumber));
+        if (withLabel)
+            newPage->setLabel(QPdfium::GetPageLabel(doc->pdfdoc(), pageNumber));
         
         return newPage;
     }
@@ -124,6 +409,8 @@ private:
             config.m_pIsolate = nullptr;
             config.m_v8EmbedderSlot = 0;
             FPDF_InitLibraryWithConfig(&config);
+            if (FPDF_SYSFONTINFO *fontInfo = QPdfium::SystemFontInfo())
+                FPDF_SetSystemFontInfo(fontInfo);
         }
         ++libraryRefCount;
     }
@@ -141,6 +428,7 @@ private:
 PDFiumGeneratorPrivate::PDFiumGeneratorPrivate()
   : synopsis(nullptr)
 {
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     QMutexLocker lock(&pdfiumMutex);
     initLibrary();
 }
@@ -149,12 +437,14 @@ PDFiumGeneratorPrivate::PDFiumGeneratorPrivate(const PDFiumGeneratorPrivate &oth
   : QSharedData(other)
   , synopsis(other.synopsis)
 {
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     QMutexLocker lock(&pdfiumMutex);
     initLibrary();
 }
 
 PDFiumGeneratorPrivate::~PDFiumGeneratorPrivate()
 {
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     QMutexLocker lock(&pdfiumMutex);
     
     pagesVector = nullptr;
@@ -193,9 +483,38 @@ Okular::Document::OpenResult PDFiumGenerator::loadDocumentWithPassword(const QSt
         return Okular::Document::OpenError;
     }
 
-    d->doc = QPdfium::Document::load(fileName, password, dpi());
+    {
+        QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
+        d->doc = QPdfium::Document::load(fileName, password, dpi());
+    }
 
-    return init(pagesVector, password);
+    const Okular::Document::OpenResult result = init(pagesVector, password);
+    if (result == Okular::Document::OpenSuccess) {
+        {
+            QMutexLocker lock(&pdfiumMutex);
+            ++openDocumentCount;
+        }
+        const int workerCount = QPdfium::RenderWorkerPool::configuredWorkerCount();
+        if (workerCount > 0 && !d->workerPool.start(fileName, password.toLatin1(), workerCount)) {
+            qDebug() << "PDFiumGenerator: render helper processes unavailable, rendering in process";
+        }
+        if (QPdfium::Prefetcher::configuredPageCount() > 0) {
+            d->prefetcher = new QPdfium::Prefetcher(d->doc, userMutex(), &d->renderCache);
+            d->prefetcher->start(QThread::LowPriority);
+        }
+        {
+            QMutexLocker locker(userMutex());
+            QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
+            d->applyMemoryLevel();
+        }
+        d->recorder = QPdfium::RequestRecorder::create(fileName, d->doc->pagesCount());
+        if (!qEnvironmentVariableIsEmpty("OKULAR_PDFIUM_STATS")) {
+            d->statsTimer = new QTimer(this);
+            connect(d->statsTimer, &QTimer::timeout, this, [this] { d->writeStatistics(); });
+            d->statsTimer->start(statsInterval);
+        }
+    }
+    return result;
 }
 
 Okular::Document::OpenResult PDFiumGenerator::init(QVector<Okular::Page*> & pagesVector, const QString &password)
@@ -232,101 +551,381 @@ void PDFiumGenerator::loadPages(QVector<Okular::Page*> &pagesVector, int rotatio
     Q_UNUSED(clear)
     
     QMutexLocker locker(userMutex());
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     
     d->pagesVector = pagesVector.data();
     
-    for (int pageNumber = 0; pageNumber < d->doc->pagesCount(); ++pageNumber) {
-        d->pagesVector[pageNumber] = d->newOkularPage(pageNumber, Okular::Rotation0, dpi());
+    // Okular reads sizes and labels when it lays the pages out and a generator can't update
+    // them later, so both are read for every page here. Labels are only looked up in
+    // documents that have them.
+    const int pageCount = d->doc->pagesCount();
+    const bool hasLabels = d->doc->hasPageLabels();
+    for (int pageNumber = 0; pageNumber < pageCount; ++pageNumber) {
+        d->pagesVector[pageNumber] = d->newOkularPage(pageNumber, Okular::Rotation0, dpi(), hasLabels);
     }
 }
 
 
 struct RenderImagePayload
 {
-    RenderImagePayload(PDFiumGenerator *g, Okular::PixmapRequest *r) :
-        generator(g), request(r)
+    RenderImagePayload(PDFiumGenerator *g, Okular::PixmapRequest *r, QElapsedTimer *a) :
+        generator(g), request(r), lastAbortTimer(a)
     {
-        // Don't report partial updates for the first 500 ms
-        timer.setInterval(500);
-        timer.setSingleShot(true);
+        // The generator thread has no event loop, so a QTimer would never fire
         timer.start();
     }
 
     PDFiumGenerator *generator;
     Okular::PixmapRequest *request;
-    QTimer timer;
+    QElapsedTimer *lastAbortTimer;
+    QElapsedTimer timer;
+    // Don't report partial updates for the first 500 ms, then at most every 250 ms
+    qint64 nextPartialUpdate {500};
 };
 Q_DECLARE_METATYPE(RenderImagePayload*)
 
+static void partialUpdateCallback(const QImage &image, const QVariant &vpayload)
+{
+    auto payload = vpayload.value<RenderImagePayload *>();
+    // The image keeps being drawn into, so hand over a copy
+    QMetaObject::invokeMethod(payload->generator, "signalPartialPixmapRequest", Qt::QueuedConnection,
+                              Q_ARG(Okular::PixmapRequest*, payload->request), Q_ARG(QImage, image.copy()));
+}
+
+static bool shouldDoPartialUpdateCallback(const QVariant &vpayload)
+{
+    auto payload = vpayload.value<RenderImagePayload *>();
+    const qint64 elapsed = payload->timer.elapsed();
+    if (elapsed < payload->nextPartialUpdate)
+        return false;
+    payload->nextPartialUpdate = elapsed + 250;
+    return true;
+}
+
+static bool shouldAbortRenderCallback(const QVariant &vpayload)
+{
+    auto payload = vpayload.value<RenderImagePayload *>();
+    if (!payload->request->shouldAbortRender())
+        return false;
+    payload->lastAbortTimer->start();
+    return true;
+}
+
+// Renders request at a fraction of its size without anti-aliasing, and scales it up
+static QImage renderDraft(const QPdfium::PagePtr &page, Okular::PixmapRequest *request,
+                          float dpiX, float dpiY, const QRect &rect, const QVariant &payload)
+{
+    const int flags = renderFlags(QPdfium::DraftTier);
+    QImage draft;
+    if (request->isTile()) {
+        const QRect scaled(qRound(rect.x() * draftScale), qRound(rect.y() * draftScale),
+                           qMax(1, qRound(rect.width() * draftScale)), qMax(1, qRound(rect.height() * draftScale)));
+        draft = page->renderToImage(dpiX * draftScale, dpiY * draftScale,
+                                    scaled.x(), scaled.y(), scaled.width(), scaled.height(),
+                                    flags, nullptr, nullptr, shouldAbortRenderCallback, payload);
+    }
+    else {
+        draft = page->image(qMax(1, qRound(rect.width() * draftScale)), qMax(1, qRound(rect.height() * draftScale)),
+                            flags, nullptr, nullptr, shouldAbortRenderCallback, payload);
+    }
+    if (draft.isNull())
+        return draft;
+    return draft.scaled(rect.size(), Qt::IgnoreAspectRatio, Qt::FastTransformation);
+}
+
+// Marks a render as pending for as long as image() runs
+class PendingRender
+{
+public:
+    explicit PendingRender(PDFiumGeneratorPrivate *d)
+      : d(d)
+    {
+        QMutexLocker locker(&d->renderStateMutex);
+        ++d->pendingRenders;
+    }
+
+    ~PendingRender()
+    {
+        QMutexLocker locker(&d->renderStateMutex);
+        if (--d->pendingRenders == 0)
+            d->rendersDone.wakeAll();
+    }
+
+private:
+    PDFiumGeneratorPrivate *d;
+};
+
+// Locks the user mutex like QMutexLocker, adding the wait to the trace and the statistics
+class UserMutexLocker
+{
+public:
+    UserMutexLocker(QMutex *mutex, PDFiumGeneratorPrivate *d, int pageNumber)
+      : mutex(mutex)
+    {
+        QPdfium::TraceSpan span("wait userMutex", pageNumber);
+        QElapsedTimer timer;
+        timer.start();
+        mutex->lock();
+        d->stats.userMutexWaitNsecs.fetchAndAddRelaxed(timer.nsecsElapsed());
+    }
+
+    ~UserMutexLocker()
+    {
+        mutex->unlock();
+    }
+
+private:
+    Q_DISABLE_COPY(UserMutexLocker)
+
+    QMutex *mutex;
+};
+
+// Counts a pixmap request in the statistics, and writes it to the trace when recording
+class AccountedPixmapRequest
+{
+public:
+    AccountedPixmapRequest(PDFiumGeneratorPrivate *d, Okular::PixmapRequest *request)
+      : d(d), recorder(d->recorder), request(request)
+    {
+        ++d->stats.pixmapRequests;
+        if (!recorder)
+            return;
+        QPdfium::RecordedPixmap pixmap;
+        pixmap.pageNumber = request->pageNumber();
+        pixmap.width = request->width();
+        pixmap.height = request->height();
+        pixmap.tile = request->isTile();
+        if (request->isTile()) {
+            const Okular::NormalizedRect &rect = request->normalizedRect();
+            pixmap.rect = QRectF(QPointF(rect.left, rect.top), QPointF(rect.right, rect.bottom));
+        }
+        pixmap.priority = request->priority();
+        pixmap.preload = request->preload();
+        pixmap.asynchronous = request->asynchronous();
+        pixmap.partialUpdates = request->partialUpdatesWanted();
+        id = recorder->pixmapStarted(pixmap);
+    }
+
+    ~AccountedPixmapRequest()
+    {
+        const bool aborted = request->shouldAbortRender();
+        if (aborted)
+            ++d->stats.abortedRequests;
+        if (recorder)
+            recorder->pixmapFinished(id, aborted);
+    }
+
+private:
+    PDFiumGeneratorPrivate *d;
+    QPdfium::RequestRecorder *recorder;
+    Okular::PixmapRequest *request;
+    quint64 id {0};
+};
+
 
 QImage PDFiumGenerator::image(Okular::PixmapRequest* request)
 {
+    AccountedPixmapRequest accounted(d.data(), request);
+    QPdfium::TraceSpan span("PDFiumGenerator::image", request->pageNumber());
+
     // compute dpi used to get an image with desired width and height
-    Okular::Page *okularPage = request->page();
+    const QSizeF fakeDpi = renderDpi(request->page(), request->width(), request->height(), dpi());
+    float fakeDpiX = fakeDpi.width();
+    float fakeDpiY = fakeDpi.height();
+    
+    PendingRender pendingRender(d.data());
+    if (d->prefetcher) {
+        d->prefetcher->yield();
+    }
+    const int pageNumber = request->pageNumber();
 
-    double pageWidth = okularPage->width(),
-           pageHeight = okularPage->height();
+    QPdfium::RenderCacheKey cacheKey;
+    cacheKey.pageNumber = pageNumber;
+    cacheKey.dpiX = fakeDpiX;
+    cacheKey.dpiY = fakeDpiY;
+    cacheKey.rect = request->isTile() ? request->normalizedRect().geometry(request->width(), request->height())
+                                      : QRect(0, 0, request->width(), request->height());
+    const bool thumbnail = !request->isTile() &&
+                           qMax(request->width(), request->height()) <= thumbnailMaxSize;
+    const QPdfium::RenderTier tier = thumbnail ? QPdfium::ThumbnailTier : QPdfium::FullTier;
+    cacheKey.flags = renderFlags(tier);
 
-    if ( okularPage->rotation() % 2 )
-        qSwap( pageWidth, pageHeight );
+    // With layers, the cache holds the page content and the form fields are drawn over a
+    // copy of it on every request, so a change of the fields doesn't render the content again
+    const bool layered = !thumbnail && d->doc->hasFormFillEnvironment();
 
-    float fakeDpiX = request->width() / pageWidth * dpi().width();
-    float fakeDpiY = request->height() / pageHeight * dpi().height();
-    
-    QMutexLocker locker(userMutex());
+    QImage img = d->renderCache.find(cacheKey);
+
+    // Okular asks for the tiles of a page one after the other. A tile is rendered as part of
+    // an aligned region around it that goes into the cache, and its neighbours are cut from
+    // that by find() instead of walking the page contents again.
+    QPdfium::RenderCacheKey renderKey = cacheKey;
+    if (request->isTile()) {
+        renderKey.rect = tileRegion(cacheKey.rect, QSize(request->width(), request->height()));
+    }
+    const bool coalesced = renderKey.rect != cacheKey.rect;
+    auto tileOf = [&](const QImage &region) {
+        return coalesced ? region.copy(cacheKey.rect.translated(-renderKey.rect.topLeft())) : region;
+    };
+
+    RenderImagePayload payload(this, request, &d->lastAbortTimer);
+    // Partial images of a region or of the content without its fields don't fit the request
+    const bool partialUpdates = request->partialUpdatesWanted() && !coalesced && !layered;
+
+    // The helper processes have their own PDFium, no need to wait for ours. Thumbnails
+    // are too small to be worth the round trip. What a helper renders still goes through
+    // the locked part below for the links of the page.
+    bool workerRendered = false;
+    if (img.isNull() && !thumbnail && d->workerPool.isRunning() && !request->shouldAbortRender()) {
+        img = d->workerPool.render(pageNumber, fakeDpiX, fakeDpiY, renderKey.rect, renderKey.flags,
+                                   partialUpdates ? partialUpdateCallback : nullptr,
+                                   partialUpdates ? shouldDoPartialUpdateCallback : nullptr,
+                                   shouldAbortRenderCallback, QVariant::fromValue(&payload));
+        ++d->stats.workerRenders;
+        if (request->shouldAbortRender()) {
+            d->lastAbortTimer.start();
+            return QImage();
+        }
+        workerRendered = !img.isNull();
+        if (workerRendered) {
+            d->renderCache.insert(renderKey, img);
+            img = tileOf(img);
+        }
+    }
+
+    if (!img.isNull() && !workerRendered && !layered) {
+        d->schedulePrefetch(request, tier, dpi());
+        return img;
+    }
+
+    UserMutexLocker locker(userMutex(), d.data(), pageNumber);
+
+    // Waits for the turn of this request among all open documents, a request that gets
+    // superseded meanwhile is dropped
+    const QPdfium::RenderPriority priority = thumbnail ? QPdfium::ThumbnailPriority
+                                           : request->isTile() ? QPdfium::TilePriority
+                                           : QPdfium::VisiblePriority;
+    QPdfium::TraceSpan serviceWait("wait RenderService", pageNumber);
+    QPdfium::RenderServiceLocker service(priority, shouldAbortRenderCallback, QVariant::fromValue(&payload));
+    serviceWait.end();
+    if (!service.isLocked()) {
+        return QImage();
+    }
+    d->applyMemoryLevel();
     
-    const int pageNumber = request->pageNumber();
     auto page = d->doc->page(pageNumber);
     
     if (request->shouldAbortRender()) {
+        d->lastAbortTimer.start();
         return QImage();
     }
     
-    if (page) {
-        request->page()->text(); // call text for trigger generate ObjectRects ??
-        
+    if (!page) {
+        return QImage();
+    }
+
+    // A page whose orientation is off gets replaced by textPage(), its links go on the new one
+    if (request->page()->orientation() == page->orientation()) {
+        d->generateObjectRects(pageNumber, page, request->page());
+    }
+    
+    if (img.isNull() && thumbnail) {
+        img = page->embeddedThumbnail(request->width(), request->height());
+        if (!img.isNull()) {
+            ++d->stats.embeddedThumbnails;
+            d->renderCache.insert(cacheKey, img);
+            return img;
+        }
+    }
+
+    if (img.isNull()) {
+        // While the view moves, show a quick draft first. The full quality render below is
+        // abortable; when it gets cancelled the page keeps the draft as a partial pixmap,
+        // which Okular asks for again once the view settles.
+        QElapsedTimer renderTimer;
+        if (partialUpdates && tier == QPdfium::FullTier && d->viewportMoving()) {
+            renderTimer.start();
+            const QImage draft = renderDraft(page, request, fakeDpiX, fakeDpiY, cacheKey.rect,
+                                             QVariant::fromValue(&payload));
+            d->stats.countRender(QPdfium::DraftTier, renderTimer.nsecsElapsed());
+            if (draft.isNull())
+                return QImage();
+            partialUpdateCallback(draft, QVariant::fromValue(&payload));
+        }
+        // Okular asks for unrotated pixmaps and rotates them itself in Okular::Page::setPixmap()
+        renderTimer.start();
         if (request->isTile()) {
-            const QRect rect = request->normalizedRect().geometry( request->width(), request->height() );
-            /*if (request->partialUpdatesWanted()) {
-                //RenderImagePayload payload( this, request );
-                //img = p->renderToImage( fakeDpiX, fakeDpiY, rect.x(), rect.y(), rect.width(), rect.height(), Poppler::Page::Rotate0,
-                //                        partialUpdateCallback, shouldDoPartialUpdateCallback, shouldAbortRenderCallback, QVariant::fromValue( &payload ) );
-                qDebug() << "image()->tile():partialUpdatesWanted() reqRect:" << rect 
-                         << " fakeDpi: " << QSizeF(fakeDpiX,fakeDpiY) 
-                         << " pageSize:" << page->size() 
-                         << " reqSize: " << QSizeF(request->width(), request->height());
-                return page->renderToImage(fakeDpiX, fakeDpiY, rect.x(), rect.y(), rect.width(), rect.height(), Okular::Rotation0);
-            }
-            else {
-                //RenderImagePayload payload( this, request );
-                //img = p->renderToImage( fakeDpiX, fakeDpiY, rect.x(), rect.y(), rect.width(), rect.height(), Poppler::Page::Rotate0,
-                //                        nullptr, nullptr, shouldAbortRenderCallback, QVariant::fromValue( &payload ) );
-                qDebug() << "image()->tile():!partialUpdatesWanted()" << rect << QSizeF(fakeDpiX,fakeDpiY) << page->size() << QSizeF(request->width(), request->height());
-                return page->renderToImage(fakeDpiX, fakeDpiY, rect.x(), rect.y(), rect.width(), rect.height(), Okular::Rotation0);
-            }*/
-            return page->renderToImage(fakeDpiX, fakeDpiY, rect.x(), rect.y(), rect.width(), rect.height(), Okular::Rotation0);
+            const QRect rect = renderKey.rect;
+            img = page->renderToImage(fakeDpiX, fakeDpiY, rect.x(), rect.y(), rect.width(), rect.height(),
+                                      renderKey.flags,
+                                      partialUpdates ? partialUpdateCallback : nullptr,
+                                      partialUpdates ? shouldDoPartialUpdateCallback : nullptr,
+                                      shouldAbortRenderCallback, QVariant::fromValue(&payload));
         }
         else {
-            return page->image(request->width(), request->height());
+            img = page->image(request->width(), request->height(), renderKey.flags,
+                              partialUpdates ? partialUpdateCallback : nullptr,
+                              partialUpdates ? shouldDoPartialUpdateCallback : nullptr,
+                              shouldAbortRenderCallback, QVariant::fromValue(&payload));
+        }
+        d->stats.countRender(tier, renderTimer.nsecsElapsed());
+        if (img.isNull()) {
+            return img;
         }
+        d->renderCache.insert(renderKey, img);
+        img = tileOf(img);
     }
-    
-    return QImage();
+
+    if (layered) {
+        img = page->drawOverlay(img, -cacheKey.rect.x(), -cacheKey.rect.y(),
+                                request->width(), request->height(), renderKey.flags);
+    }
+
+    d->schedulePrefetch(request, tier, dpi());
+    return img;
 }
 
 bool PDFiumGenerator::doCloseDocument()
 {
     QMutexLocker locker(userMutex());
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     
+    if (d->statsTimer) {
+        d->writeStatistics();
+        delete d->statsTimer;
+        d->statsTimer = nullptr;
+    }
+
+    // It never waits for the user mutex, stopping it while holding that is fine
+    if (d->prefetcher) {
+        delete d->prefetcher;
+        d->prefetcher = nullptr;
+    }
+    delete d->recorder;
+    d->recorder = nullptr;
+    bool documentClosed = false;
     if (d->doc) {
         delete d->doc;
         d->doc = nullptr;
+        documentClosed = true;
     }
     if (d->synopsis) {
         delete d->synopsis;
         d->synopsis = nullptr;
     }
     d->rectsGenerated.clear();
+    d->pagesVector = nullptr;
+    d->memoryLevel = -1;
+    d->workerPool.stop();
+
+    d->renderCache.clear();
+    if (documentClosed) {
+        // The pool is shared with the other open documents, it is emptied after the last one
+        QMutexLocker lock(&pdfiumMutex);
+        if (!--openDocumentCount)
+            QPdfium::ReleasePooledBitmaps();
+    }
+    QPdfium::Trace::dump();
     
     return true;
 }
@@ -337,6 +936,7 @@ Okular::DocumentInfo PDFiumGenerator::generateDocumentInfo(const QSet<Okular::Do
     docInfo.set(Okular::DocumentInfo::MimeType, QStringLiteral("application/pdf"));
 
     QMutexLocker locker(userMutex());
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     
     if (d->doc) {
 #define SET(key, val) if (keys.contains(key)) { docInfo.set(key, val); }
@@ -365,7 +965,9 @@ const Okular::DocumentSynopsis *PDFiumGenerator::generateDocumentSynopsis()
     }
 
     QMutexLocker locker(userMutex());
+    QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
     
+    QPdfium::TraceSpan span("build TOC");
     d->synopsis = new Okular::DocumentSynopsis();
     d->recurseCreateTOC(*d->synopsis, nullptr, *d->synopsis);
 
@@ -376,34 +978,55 @@ Okular::TextPage* PDFiumGenerator::textPage(Okular::TextRequest *request)
 {
     const int pageNumber = request->page()->number();
     Okular::TextPage* result = new Okular::TextPage;
+    const quint64 recordedId = d->recorder ? d->recorder->textStarted(pageNumber) : 0;
+    QPdfium::TraceSpan span("PDFiumGenerator::textPage", pageNumber);
+    ++d->stats.textRequests;
 
-    QMutexLocker locker(userMutex());
+    if (d->prefetcher) {
+        d->prefetcher->yield();
+    }
+
+    // Okular asks for the text of every page it renders, at the same time as the pixmap.
+    // Let the renders go first so text doesn't add to the time to first paint, but not
+    // for long, a steady stream of renders while scrolling would hold text back for good.
+    {
+        QPdfium::TraceSpan rendersWait("wait renders", pageNumber);
+        QElapsedTimer waitTimer;
+        waitTimer.start();
+        QMutexLocker renderStateLocker(&d->renderStateMutex);
+        while (d->pendingRenders > 0) {
+            const qint64 remaining = textRenderWaitMax - waitTimer.elapsed();
+            if (remaining <= 0)
+                break;
+            d->rendersDone.wait(&d->renderStateMutex, static_cast<unsigned long>(remaining));
+        }
+    }
+
+    UserMutexLocker locker(userMutex(), d.data(), pageNumber);
+    QPdfium::RenderServiceLocker service(QPdfium::VisiblePriority);
     
     auto page = d->doc->page(pageNumber);
     if (page) {
         auto pageWidth  = page->size().width();
         auto pageHeight = page->size().height();
-        auto entityList = page->charEntityList();
+        const QPdfium::TextLayout layout = page->textLayout();
     
-        foreach (QPdfium::CharEntity *entity, entityList) {
-            result->append(entity->str, new Okular::NormalizedRect(entity->area, pageWidth, pageHeight));
+        for (int idx = 0; idx < layout.count(); ++idx) {
+            result->append(layout.text(idx), new Okular::NormalizedRect(layout.box(idx).toRect(), pageWidth, pageHeight));
         }
 
-        // generate links rects & change page orientation only the first time
-        bool genObjectRects = !d->rectsGenerated.at(pageNumber);
-        if (genObjectRects) {
-            if (page->hasLinks()) {
-                request->page()->setObjectRects(page->links());
-            }
-
-            // Change page orientation
-            if (request->page()->orientation() != page->orientation()) {
-                auto oldPage = d->pagesVector[pageNumber];
-                d->pagesVector[pageNumber] = d->newOkularPage(pageNumber, page->orientation(), dpi());
-                delete oldPage;
-            }
+        // Change page orientation, before the links are set so they end up on the new page
+        if (request->page()->orientation() != page->orientation()) {
+            auto oldPage = d->pagesVector[pageNumber];
+            d->pagesVector[pageNumber] = d->newOkularPage(pageNumber, page->orientation(), dpi());
+            delete oldPage;
         }
-        d->rectsGenerated[pageNumber] = true;
+
+        d->generateObjectRects(pageNumber, page, d->pagesVector[pageNumber]);
+    }
+
+    if (d->recorder) {
+        d->recorder->textFinished(recordedId);
     }
 
     return result;
@@ -423,18 +1046,23 @@ QVariant PDFiumGenerator::metaData(const QString& key, const QVariant& option) c
         Okular::DocumentViewport viewport;
 
         QMutexLocker locker(userMutex());
+        QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
         FPDF_DEST dest = FPDF_GetNamedDestByName(d->doc->pdfdoc(), optionStr.toLatin1().constData());
         if (d->fillDocumentViewport(dest, &viewport))
             return viewport.toString();
     }
     else if (key == QLatin1String("DocumentTitle")) {
         QMutexLocker locker(userMutex());
+        QPdfium::RenderServiceLocker service(QPdfium::InteractivePriority);
         return d->doc->metaText("Title");
     }
     else if (key == QLatin1String("OpenTOC")) {
         QMutexLocker locker(userMutex());
         return d->doc->pageMode() == QPdfium::PageMode_UseOutlines;
     }
+    else if (key == QLatin1String("PDFiumStats")) {
+        return d->statistics();
+    }
     return QVariant();
 }
 
@@ -0,0 +1,173 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QAtomicInteger>
+#include <QDebug>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStorageInfo>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include "mapped_file.h"
+
+namespace QPdfium {
+
+#ifdef Q_OS_LINUX
+
+// Mappings under a lease, looked up by the signal handler, which can't take locks
+struct LeaseSlot
+{
+    QAtomicInteger<int> fd;
+    uchar *data;
+    qint64 size;
+};
+
+static const int maxLeases = 64;
+static LeaseSlot leases[maxLeases];
+static QMutex leasesMutex;
+static bool handlerInstalled = false;
+static struct sigaction previousAction;
+
+// Lease breaks are sent as SIGIO, with the descriptor in si_fd because of F_SETSIG
+static void onLeaseBreak(int signal, siginfo_t *info, void *context)
+{
+    for (LeaseSlot &lease : leases) {
+        if (info->si_fd < 0 || lease.fd.loadAcquire() != info->si_fd)
+            continue;
+        // The writer waits until the lease goes, so the file is still whole here. Only
+        // system calls and memcpy(), this runs in a signal handler.
+        void *copy = mmap(nullptr, size_t(lease.size), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (copy != MAP_FAILED) {
+            memcpy(copy, lease.data, size_t(lease.size));
+            mprotect(copy, size_t(lease.size), PROT_READ);
+            // Atomically replaces the file pages, readers never see a hole
+            if (mremap(copy, size_t(lease.size), size_t(lease.size), MREMAP_MAYMOVE | MREMAP_FIXED,
+                       lease.data) == MAP_FAILED)
+                munmap(copy, size_t(lease.size));
+        }
+        fcntl(info->si_fd, F_SETLEASE, F_UNLCK);
+        return;
+    }
+
+    if (previousAction.sa_flags & SA_SIGINFO) {
+        if (previousAction.sa_sigaction)
+            previousAction.sa_sigaction(signal, info, context);
+    }
+    else if (previousAction.sa_handler != SIG_DFL && previousAction.sa_handler != SIG_IGN) {
+        previousAction.sa_handler(signal);
+    }
+}
+
+static bool installHandler()
+{
+    if (handlerInstalled)
+        return true;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onLeaseBreak;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    handlerInstalled = sigaction(SIGIO, &action, &previousAction) == 0;
+    return handlerInstalled;
+}
+
+static bool isOnNetworkFileSystem(const QString &filePath)
+{
+    static const QList<QByteArray> networkFileSystems {
+        "nfs", "nfs4", "cifs", "smb3", "smbfs", "fuse.sshfs", "9p", "afs"
+    };
+    return networkFileSystems.contains(QStorageInfo(filePath).fileSystemType());
+}
+
+MappedFile *MappedFile::map(int fd, const QString &filePath)
+{
+    if (fd < 0 || isOnNetworkFileSystem(filePath))
+        return nullptr;
+
+    QMutexLocker locker(&leasesMutex);
+    int slot = 0;
+    while (slot < maxLeases && leases[slot].fd.loadAcquire() >= 0)
+        ++slot;
+    if (slot == maxLeases || !installHandler())
+        return nullptr;
+
+    // The lease comes first, so the size can't change between fstat() and mmap()
+    if (fcntl(fd, F_SETSIG, SIGIO) != 0 || fcntl(fd, F_SETLEASE, F_RDLCK) != 0) {
+        qDebug() << "QPdfium::MappedFile: no lease on" << filePath << strerror(errno);
+        return nullptr;
+    }
+
+    struct stat status;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && status.st_size > 0)
+        data = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        fcntl(fd, F_SETLEASE, F_UNLCK);
+        return nullptr;
+    }
+
+    leases[slot].data = static_cast<uchar*>(data);
+    leases[slot].size = status.st_size;
+    leases[slot].fd.storeRelease(fd);
+    return new MappedFile(fd, static_cast<uchar*>(data), status.st_size, slot);
+}
+
+MappedFile::~MappedFile()
+{
+    {
+        QMutexLocker locker(&leasesMutex);
+        fcntl(fd, F_SETLEASE, F_UNLCK);
+        leases[slot].fd.storeRelease(-1);
+    }
+    munmap(mapped, size_t(mappedSize));
+}
+
+#else
+
+MappedFile *MappedFile::map(int fd, const QString &filePath)
+{
+    Q_UNUSED(fd)
+    Q_UNUSED(filePath)
+    return nullptr;
+}
+
+MappedFile::~MappedFile()
+{
+}
+
+#endif
+
+MappedFile::MappedFile(int fd, uchar *data, qint64 size, int slot)
+  : fd(fd), mapped(data), mappedSize(size), slot(slot)
+{
+}
+
+uchar *MappedFile::data() const
+{
+    return mapped;
+}
+
+qint64 MappedFile::size() const
+{
+    return mappedSize;
+}
+
+}
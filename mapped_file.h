@@ -0,0 +1,54 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_MAPPED_FILE_H
+#define QPDFIUM_MAPPED_FILE_H
+
+#include <QString>
+#include <QtGlobal>
+
+namespace QPdfium {
+
+/*
+ * A read only mapping of a whole file that survives the file being truncated or
+ * rewritten in place, e.g. by a LaTeX rebuild, where a plain mapping raises SIGBUS.
+ *
+ * The mapping holds a read lease on the file. When another process opens the file
+ * for writing or truncates it, the kernel signals the lease holder and holds that
+ * process back; the mapped pages are then copied into anonymous memory at the same
+ * address and the lease is released. Readers of data() keep seeing the file as it
+ * was when it was mapped.
+ *
+ * Leases need Linux, a local filesystem and a file owned by the user that nobody
+ * has open for writing. map() returns null otherwise, and on network filesystems,
+ * where writes of other machines don't break leases.
+ */
+class MappedFile
+{
+public:
+    // fd must stay open for as long as the mapping exists
+    static MappedFile *map(int fd, const QString &filePath);
+    ~MappedFile();
+
+    uchar *data() const;
+    qint64 size() const;
+
+private:
+    MappedFile(int fd, uchar *data, qint64 size, int slot);
+    Q_DISABLE_COPY(MappedFile)
+
+    int fd;
+    uchar *mapped;
+    qint64 mappedSize;
+    int slot;
+};
+
+}
+
+#endif // QPDFIUM_MAPPED_FILE_H
@@ -14,7 +14,13 @@
 #include <pdfium/fpdf_ext.h>
 #include <pdfium/fpdf_text.h>
 #include <pdfium/fpdf_sysfontinfo.h>
+#include <pdfium/fpdf_progressive.h>
+#include <pdfium/fpdf_formfill.h>
+#ifdef HAVE_FPDF_THUMBNAIL
+#include <pdfium/fpdf_thumbnail.h>
+#endif
 
+#include <QAtomicInteger>
 #include <QImage>
 #include <QMutex>
 #include <QMutexLocker>
@@ -25,18 +31,71 @@
 #include <okular/core/page.h>
 
 #include "pdfium_utils.h"
+#include "bitmap_pool.h"
+#include "text_cache.h"
 #include "page.h"
+#include "render_service.h"
+#include "trace.h"
 
 namespace QPdfium {
 
+static QAtomicInteger<quint64> pagesLoaded;
+static QAtomicInteger<quint64> pagesClosed;
+static QAtomicInteger<quint64> textPagesLoaded;
+static QAtomicInteger<quint64> textPagesClosed;
+static QAtomicInteger<quint64> textLayoutsExtracted;
+static QAtomicInteger<quint64> linkListsExtracted;
+
+// Lets PDFium's progressive renderer poll the caller for cancellation and partial updates
+struct RenderPause : public IFSDK_PAUSE
+{
+    RenderPause(ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                ShouldAbortRenderCallback shouldAbortRenderCallback,
+                const QVariant &payload)
+      : shouldDoPartialUpdateCallback(shouldDoPartialUpdateCallback)
+      , shouldAbortRenderCallback(shouldAbortRenderCallback)
+      , payload(payload)
+    {
+        version = 1;
+        NeedToPauseNow = &RenderPause::needToPauseNow;
+        user = nullptr;
+    }
+
+    bool shouldAbort() const
+    {
+        return shouldAbortRenderCallback && shouldAbortRenderCallback(payload);
+    }
+
+    static FPDF_BOOL needToPauseNow(IFSDK_PAUSE *pThis)
+    {
+        RenderPause *pause = static_cast<RenderPause*>(pThis);
+        if (pause->shouldAbort())
+            return true;
+        if (pause->shouldDoPartialUpdateCallback && pause->shouldDoPartialUpdateCallback(pause->payload)) {
+            pause->partialUpdateDue = true;
+            return true;
+        }
+        // The render loop yields once PDFium has returned
+        return RenderService::instance()->hasMoreImportantWaiter();
+    }
+
+    ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback;
+    ShouldAbortRenderCallback shouldAbortRenderCallback;
+    QVariant payload;
+    bool partialUpdateDue {false};
+};
+
 class PagePrivate
 {
 public:
-    PagePrivate(FPDF_DOCUMENT pdfdoc, int pageNumber, const QSizeF &dpi)
+    PagePrivate(FPDF_DOCUMENT pdfdoc, int pageNumber, const QSizeF &dpi, TextCache *textCache,
+                FPDF_FORMHANDLE form)
     {
         this->pdfdoc = pdfdoc;
+        this->form = form;
         this->pageNumber = pageNumber;
         this->dpi = dpi;
+        this->textCache = textCache;
     }
 
     ~PagePrivate()
@@ -44,12 +103,13 @@ public:
         QMutexLocker locker(&mutex);
         closeTextPage();
         closePage();
-        clearCharEntityList();
-        clearLinks();
+        textLayout = TextLayout();
     }
 
     Okular::Rotation getOrientation()
     {
+        if (orientationReady)
+            return orientation;
         if (getPage()) {
             const int fzOrientation = FPDFPage_GetRotation(fzPage);
             switch (fzOrientation)
@@ -59,14 +119,57 @@ public:
             case 3: orientation = Okular::Rotation270; break;
             case 0: orientation = Okular::Rotation0;   break;
             }
+            orientationReady = true;
         }
         return orientation;
     }
 
+    // Takes text, links and orientation from the text cache, once. Without wait, gives up
+    // while the document is still being hashed.
+    bool loadFromTextCache(bool wait = true)
+    {
+        if (textCacheChecked)
+            return textCacheHit;
+        if (!wait && textCache && !textCache->isReady())
+            return false;
+        textCacheChecked = true;
+
+        PageTextData data;
+        if (textCache && textCache->load(pageNumber, &data)) {
+            textLayout = data.layout;
+            textLayoutReady = true;
+            linkEntities = data.links;
+            linksReady = true;
+            orientation = data.orientation;
+            orientationReady = true;
+            textCacheHit = true;
+        }
+        return textCacheHit;
+    }
+
+    void storeToTextCache()
+    {
+        if (!textCache || textCacheHit || !textLayoutReady || !textCache->isEnabled())
+            return;
+
+        PageTextData data;
+        data.layout = textLayout;
+        data.links = getLinkEntities();
+        data.orientation = getOrientation();
+        textCache->store(pageNumber, data);
+        textCacheHit = true;
+    }
+
     FPDF_PAGE getPage()
     {
         if (!fzPage) {
+            TraceSpan span("FPDF_LoadPage", pageNumber);
             fzPage = FPDF_LoadPage(pdfdoc, pageNumber);
+            if (fzPage)
+                ++pagesLoaded;
+            objectCount = fzPage ? FPDFPage_CountObjects(fzPage) : 0;
+            if (fzPage && form)
+                FORM_OnAfterLoadPage(fzPage, form);
         }
         return fzPage;
     }
@@ -74,15 +177,21 @@ public:
     void closePage()
     {
         if (fzPage) {
+            if (form)
+                FORM_OnBeforeClosePage(fzPage, form);
             FPDF_ClosePage(fzPage);
             fzPage = nullptr;
+            ++pagesClosed;
         }
     }
 
     FPDF_TEXTPAGE getTextPage()
     {
         if (!textPage && getPage()) {
+            TraceSpan span("FPDFText_LoadPage", pageNumber);
             textPage = FPDFText_LoadPage(getPage());
+            if (textPage)
+                ++textPagesLoaded;
             numChars = FPDFText_CountChars(textPage);
             numRects = FPDFText_CountRects(textPage, 0, numChars);
         }
@@ -94,6 +203,7 @@ public:
         if (textPage) {
             FPDFText_ClosePage(textPage);
             textPage = nullptr;
+            ++textPagesClosed;
         }
     }
 
@@ -113,100 +223,246 @@ public:
         return pageSize;
     }
 
-    QImage image(const int &width, const int &height)
+    // Renders the page progressively into bitmap, which draws into target, and
+    // returns false when the render was aborted
+    bool renderBitmap(FPDF_BITMAP bitmap, const QImage &target,
+                      int startX, int startY, int sizeX, int sizeY, int renderFlags,
+                      PartialUpdateCallback partialUpdateCallback,
+                      ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                      ShouldAbortRenderCallback shouldAbortRenderCallback,
+                      const QVariant &payload)
     {
-        if (getPage() && (cachedImage.isNull() || (cachedImage.size() != QSize(width, height)))) {
-            QImage img(width, height, QImage::Format_RGBA8888);
+        TraceSpan span("render", pageNumber);
+        RenderPause pause(partialUpdateCallback ? shouldDoPartialUpdateCallback : nullptr,
+                          shouldAbortRenderCallback, payload);
+        bool aborted = false;
+
+        int status = FPDF_RenderPageBitmap_Start(bitmap, fzPage, startX, startY, sizeX, sizeY, 0, renderFlags, &pause);
+        while (status == FPDF_RENDER_TOBECONTINUED) {
+            if (pause.shouldAbort()) {
+                aborted = true;
+                break;
+            }
+            if (pause.partialUpdateDue) {
+                pause.partialUpdateDue = false;
+                partialUpdateCallback(target, payload);
+            }
+            // Between steps, so PDFium is free for other documents
+            RenderService::instance()->yield();
+            status = FPDF_RenderPage_Continue(fzPage, &pause);
+        }
+        FPDF_RenderPage_Close(fzPage);
+
+        return !aborted && status == FPDF_RENDER_DONE;
+    }
+
+    QImage image(const int &width, const int &height, int renderFlags,
+                 PartialUpdateCallback partialUpdateCallback,
+                 ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                 ShouldAbortRenderCallback shouldAbortRenderCallback,
+                 const QVariant &payload)
+    {
+        // Pooled buffers hold old pixels, don't hand them out unless the page was drawn
+        if (!getPage())
+            return QImage();
+        QImage img = AllocateRenderImage(width, height);
+        if (!img.isNull()) {
             FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(img.width(), img.height()
-                                                    , FPDFBitmap_BGRA
+                                                    , FPDFBitmap_BGRx
                                                     , img.bits()
                                                     , img.bytesPerLine()
                                                     );
             if (bitmap) {
-                img.fill(0xFFFFFFFF);
-                int renderFlags = 0;
-                renderFlags |= FPDF_ANNOT;
-                renderFlags |= FPDF_LCD_TEXT;
-                renderFlags |= FPDF_REVERSE_BYTE_ORDER;
+                FPDFBitmap_FillRect(bitmap, 0, 0, img.width(), img.height(), 0xFFFFFFFF);
                 //renderFlags |= FPDF_PRINTING;
                 
-                FPDF_RenderPageBitmap(bitmap, fzPage, 0, 0, img.width(), img.height(), 0, renderFlags);
+                const bool done = renderBitmap(bitmap, img, 0, 0, img.width(), img.height(), renderFlags,
+                                               partialUpdateCallback, shouldDoPartialUpdateCallback,
+                                               shouldAbortRenderCallback, payload);
                 FPDFBitmap_Destroy(bitmap);
+                if (!done)
+                    return QImage();
             }
-            else
+            else {
                 qDebug() << "PagePrivate::image() : Can't create Bitmap";
-            
-            cachedImage = img;
+                return QImage();
+            }
         }
-        return cachedImage;
+        return img;
     }
 
-    QImage renderToImage(float dpiX, float dpiY, int x, int y, int width, int height, Okular::Rotation rotation)
+    QImage renderToImage(float dpiX, float dpiY, int x, int y, int width, int height, int renderFlags,
+                         PartialUpdateCallback partialUpdateCallback,
+                         ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                         ShouldAbortRenderCallback shouldAbortRenderCallback,
+                         const QVariant &payload)
     {
-        Q_UNUSED(rotation)
-        
-        QImage img(width, height, QImage::Format_ARGB32);
-        if (getPage()) {
+        // Pooled buffers hold old pixels, don't hand them out unless the page was drawn
+        if (!getPage())
+            return QImage();
+        QImage img = AllocateRenderImage(width, height);
+        if (!img.isNull()) {
             FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(img.width(), img.height()
-                                                    , FPDFBitmap_BGRA
+                                                    , FPDFBitmap_BGRx
                                                     , img.bits()
                                                     , img.bytesPerLine()
                                                     );
             if (bitmap) {
-                img.fill(0xFFFFFFFF);
-                int renderFlags = 0;
-                renderFlags |= FPDF_ANNOT;
-                renderFlags |= FPDF_LCD_TEXT;
-                renderFlags |= FPDF_REVERSE_BYTE_ORDER;
-                //renderFlags |= FPDF_PRINTING;
+                FPDFBitmap_FillRect(bitmap, 0, 0, img.width(), img.height(), 0xFFFFFFFF);
                 
-                FS_MATRIX renderMatrix { dpiX/72.f, 0, 0, dpiY/72.f, -float(x), -float(y) };
-                FS_RECTF clipRect { 0, 0, float(img.width()-1), float(img.height()-1) };
-                FPDF_RenderPageBitmapWithMatrix(bitmap, fzPage, &renderMatrix, &clipRect, 0);
+                // The tile is a window at (x, y) into the whole page rendered at dpiX x dpiY
+                const int pageWidth  = qRound(FPDF_GetPageWidth(fzPage) / 72.0 * dpiX);
+                const int pageHeight = qRound(FPDF_GetPageHeight(fzPage) / 72.0 * dpiY);
+                const bool done = renderBitmap(bitmap, img, -x, -y, pageWidth, pageHeight, renderFlags,
+                                               partialUpdateCallback, shouldDoPartialUpdateCallback,
+                                               shouldAbortRenderCallback, payload);
                 FPDFBitmap_Destroy(bitmap);
+                if (!done)
+                    return QImage();
             }
+            else
+                return QImage();
         }
         return img;
     }
     
-    void clearCharEntityList()
+    QImage drawOverlay(const QImage &content, int startX, int startY, int sizeX, int sizeY, int renderFlags)
+    {
+        if (!form || content.isNull() || !getPage())
+            return content;
+
+        // The content has the markup annotations already, FFLDraw adds the widgets on top.
+        // bits() detaches, so a cached content image stays as it is.
+        QImage result = content;
+        FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(result.width(), result.height()
+                                                , FPDFBitmap_BGRx
+                                                , result.bits()
+                                                , result.bytesPerLine()
+                                                );
+        if (!bitmap)
+            return content;
+        FPDF_FFLDraw(form, bitmap, fzPage, startX, startY, sizeX, sizeY, 0, renderFlags);
+        FPDFBitmap_Destroy(bitmap);
+        return result;
+    }
+
+    // The thumbnail stored in the file, scaled to width x height; null when the page has
+    // none or it is too small to be scaled up without getting blurry
+    QImage getEmbeddedThumbnail(int width, int height)
     {
-        qDeleteAll(charEntityList);
-        charEntityList.clear();
+#ifdef HAVE_FPDF_THUMBNAIL
+        if (!getPage())
+            return QImage();
+
+        FPDF_BITMAP bitmap = FPDFPage_GetThumbnailAsBitmap(fzPage);
+        if (!bitmap)
+            return QImage();
+
+        const int thumbWidth  = FPDFBitmap_GetWidth(bitmap);
+        const int thumbHeight = FPDFBitmap_GetHeight(bitmap);
+        const uchar *buffer   = static_cast<const uchar*>(FPDFBitmap_GetBuffer(bitmap));
+        const int stride      = FPDFBitmap_GetStride(bitmap);
+
+        QImage thumb;
+        if (thumbWidth * 4 >= width * 3 && thumbHeight * 4 >= height * 3) {
+            switch (FPDFBitmap_GetFormat(bitmap)) {
+            case FPDFBitmap_Gray:
+                thumb = QImage(buffer, thumbWidth, thumbHeight, stride, QImage::Format_Grayscale8).copy();
+                break;
+            case FPDFBitmap_BGR:
+                thumb = QImage(buffer, thumbWidth, thumbHeight, stride, QImage::Format_RGB888).rgbSwapped();
+                break;
+            case FPDFBitmap_BGRx:
+                thumb = QImage(buffer, thumbWidth, thumbHeight, stride, QImage::Format_RGB32).copy();
+                break;
+            case FPDFBitmap_BGRA:
+                thumb = QImage(buffer, thumbWidth, thumbHeight, stride, QImage::Format_ARGB32).copy();
+                break;
+            }
+        }
+        FPDFBitmap_Destroy(bitmap);
+
+        if (thumb.isNull())
+            return QImage();
+        return thumb.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+                    .convertToFormat(RenderImageFormat);
+#else
+        Q_UNUSED(width)
+        Q_UNUSED(height)
+        return QImage();
+#endif
     }
 
-    QList<CharEntity*> getCharEntityList()
+    qint64 memoryUsage() const
     {
-        if (!getTextPage())
-            return charEntityList;
+        // PDFium doesn't expose its allocations, so estimate them from what we know
+        // about the parsed page: the page objects and the characters of the text page.
+        qint64 bytes = sizeof(PagePrivate);
+        if (fzPage)
+            bytes += 16 * 1024 + qint64(objectCount) * 512;
+        if (textPage)
+            bytes += qint64(numChars) * 160;
+        bytes += qint64(textLayout.unicode.capacity()) * sizeof(uint);
+        bytes += qint64(textLayout.boxes.capacity()) * sizeof(float);
+        bytes += qint64(linkEntities.count()) * 256;
+        return bytes;
+    }
 
-        if (!charEntityList.isEmpty())
-            return charEntityList;
+    // False when the text cache is still hashing the document, which would be waited for
+    bool prefetchTextLayout()
+    {
+        // The cache stays unchecked until the document key is there
+        loadFromTextCache(false);
+        if (!textLayoutReady && !textCacheChecked)
+            return false;
+        getTextLayout();
+        return true;
+    }
 
-        int rectIdx = 0;
-        QRectF lineRect;
+    TextLayout getTextLayout()
+    {
+        if (textLayoutReady || loadFromTextCache() || !getTextPage())
+            return textLayout;
+
+        TraceSpan span("extract text", pageNumber);
+        ++textLayoutsExtracted;
+
+        QVector<uint> unicode(numChars);
+        QVector<float> boxes(numChars * 4, 0.f);
+
+        // All the text in one call. Characters outside the BMP come as surrogate pairs, so the
+        // buffer may need two units per character, and the pairs are folded back into one.
+        // The count returned includes the terminating NUL; characters past it, if any, are
+        // read one by one.
+        QVector<ushort> utf16(numChars * 2 + 1);
+        const int written = numChars > 0
+            ? qBound(0, FPDFText_GetText(textPage, 0, numChars, utf16.data()) - 1, numChars) : 0;
+        int pos = 0;
         for (int idx = 0; idx < numChars; ++idx) {
-            CharEntity *entity = new CharEntity;
-            charEntityList.append(entity);
-
-            const ushort unicode = FPDFText_GetUnicode(textPage, idx);
-            QString chStr;
-            chStr += unicode;
+            if (pos >= written) {
+                unicode[idx] = FPDFText_GetUnicode(textPage, idx);
+                continue;
+            }
+            uint ucs = utf16.at(pos++);
+            if (QChar::isHighSurrogate(ucs) && pos < written && QChar::isLowSurrogate(utf16.at(pos)))
+                ucs = QChar::surrogateToUcs4(ushort(ucs), utf16.at(pos++));
+            unicode[idx] = ucs;
+        }
 
-            QRectF charBox = QPdfium::GetFloatCharRectInPixels(fzPage, textPage, idx).normalized();
+        const QTransform toDevice = QPdfium::GetPageToDeviceTransform(fzPage);
+        int rectIdx = 0;
+        QRectF lineRect;
+        float *box = boxes.data();
+        for (int idx = 0; idx < numChars; ++idx, box += 4) {
+            const QRectF charBox = toDevice.mapRect(QPdfium::GetFloatCharRect(textPage, idx)).normalized();
             if (charBox.width() <= 0.00001 || charBox.height() <= 0.00001) {
-                if (idx-1 > 0) {
-                    QRect chBox = charBox.toRect();
-                    QRect lastBox = charEntityList.at(idx-1)->area;
-                    QRect escRect;
-                    if (unicode=='\r' || unicode=='\n') {
-                        escRect = QRect(lastBox.x()+lastBox.width()-1, lastBox.y(), 1, lastBox.height());
-                    }
-                    else {
-                        escRect = QRect(lastBox.right()-1, lastBox.y(), chBox.width(), lastBox.height());
-                    }
-                    charEntityList.at(idx)->str   = chStr;
-                    charEntityList.at(idx)->area  = escRect;
+                if (idx > 0) {
+                    const float *lastBox = box - 4;
+                    const bool lineBreak = (unicode.at(idx) == '\r' || unicode.at(idx) == '\n');
+                    box[0] = lastBox[2] - 1.f;
+                    box[1] = lastBox[1];
+                    box[2] = lineBreak ? lastBox[2] : box[0] + float(charBox.width());
+                    box[3] = lastBox[3];
                 }
                 continue;
             }
@@ -214,51 +470,46 @@ public:
             if ((lineRect.isEmpty() || !lineRect.intersects(charBox)) && rectIdx+1 <= numRects) {
                 double rt_left, rt_top, rt_right, rt_bottom;
                 FPDFText_GetRect(textPage, rectIdx++, &rt_left, &rt_top, &rt_right, &rt_bottom);
-                lineRect = QPdfium::FloatPageRectToPixelRect(fzPage, QRectF(rt_left, rt_top, rt_right - rt_left, rt_bottom - rt_top));
+                lineRect = toDevice.mapRect(QRectF(rt_left, rt_top, rt_right - rt_left, rt_bottom - rt_top)).normalized();
             }
 
-            float ntop    = qMin(lineRect.top(), charBox.top());
-            float nbottom = qMax(lineRect.bottom(), charBox.bottom());
+            box[0] = charBox.left();
+            box[1] = qMin(lineRect.top(), charBox.top());
+            box[2] = charBox.right();
+            box[3] = qMax(lineRect.bottom(), charBox.bottom());
 
-            charEntityList.at(idx)->str  = chStr;
-            charEntityList.at(idx)->area = QRectF(charBox.left(), ntop, charBox.width(), nbottom - ntop).toRect();
-
-            if (idx-1 >= 0 && charEntityList.at(idx-1)->area.top() == charEntityList.at(idx)->area.top()) {
-                charEntityList.at(idx-1)->area.setRight(charEntityList.at(idx)->area.left());
+            // Close the gap to the previous character on the same line
+            if (idx > 0) {
+                float *lastBox = box - 4;
+                if (qAbs(lastBox[1] - box[1]) < 0.5f)
+                    lastBox[2] = box[0];
             }
         }
 
-        return charEntityList;
+        textLayout.unicode = unicode;
+        textLayout.boxes = boxes;
+        textLayoutReady = true;
+        storeToTextCache();
+        return textLayout;
     }
     
     bool hasLinks()
     {
-        if (getPage() && !isHasLinks) {
-            int linkPos = 0;
-            FPDF_LINK linkAnnot;
-            isHasLinks = FPDFLink_Enumerate(fzPage, &linkPos, &linkAnnot);
-        }
-        return isHasLinks;
+        return !getLinkEntities().isEmpty();
     }
 
-    void clearLinks()
+    QVector<LinkEntity> getLinkEntities()
     {
-        if (!links.isEmpty()) {
-            //qDeleteAll(links); // Okular::Page will delete these objects instance itself
-            links.clear();
-        }
-    }
-    
-    QLinkedList<Okular::ObjectRect*> getLinks()
-    {
-        if (!getPage())
-            return links;
+        // Links are asked for by renders, which don't wait for the text cache
+        if (linksReady || loadFromTextCache(false) || !getPage())
+            return linkEntities;
 
-        if (!links.isEmpty())
-            return links;
+        TraceSpan span("enumerate links", pageNumber);
+        ++linkListsExtracted;
 
-        const qreal width   = pageSize.width();
-        const qreal height  = pageSize.height();
+        const QSizeF size   = getPageSize();
+        const qreal width   = size.width();
+        const qreal height  = size.height();
 
         int linkPos = 0;
         FPDF_LINK linkAnnot;
@@ -287,36 +538,56 @@ public:
                 qreal nWidth  = (rect.right - rect.left);
                 qreal nHeight = (rect.bottom - rect.top);
                 FPDF_PageToDevice(fzPage, 0, 0, width, height, 0, rect.left, rect.top, &devX, &devY);
-                QRectF boundary = QRectF(devX/width, (devY - nHeight)/height, nWidth/width, nHeight/height);
 
-                Okular::Action *okularAction = nullptr;
+                LinkEntity link;
+                link.boundary = QRectF(devX/width, (devY - nHeight)/height, nWidth/width, nHeight/height);
+                link.targetPage = targetPage;
+                link.uri = uriStr;
                 if (targetPage != -1) { // internal link
-                    Okular::DocumentViewport viewport(targetPage);
                     QPointF targetPointF = QPdfium::GetLocationInPage(destination);
                     if (!targetPointF.isNull()) {
                         auto targetSizeF = QPdfium::GetPageSizeF(pdfdoc, targetPage);
-                        viewport.rePos.pos = Okular::DocumentViewport::TopLeft;
-                        viewport.rePos.normalizedX = targetPointF.x() / targetSizeF.width();
-                        viewport.rePos.normalizedY = (targetSizeF.height() - targetPointF.y()) / targetSizeF.height();
-                        viewport.rePos.enabled = true;
+                        link.targetPosition = QPointF(targetPointF.x() / targetSizeF.width(),
+                                                      (targetSizeF.height() - targetPointF.y()) / targetSizeF.height());
                     }
-                    okularAction = new Okular::GotoAction(uriStr, viewport);
-                }
-                else if (!uriStr.isNull()) { // external link
-                    okularAction = new Okular::BrowseAction(QUrl(uriStr));
                 }
+                linkEntities.append(link);
+            }
+        }
+        linksReady = true;
+        
+        return linkEntities;
+    }
 
-                if (okularAction) {
-                    Okular::ObjectRect *rect = new Okular::ObjectRect(
-                                boundary.left(), boundary.top(), boundary.right(), boundary.bottom(), 
-                                false, 
-                                Okular::ObjectRect::Action, 
-                                okularAction);
-                    links.push_back(rect);
+    // Okular::Page takes ownership of the returned objects, so they are created on every call
+    QLinkedList<Okular::ObjectRect*> getLinks()
+    {
+        QLinkedList<Okular::ObjectRect*> links;
+        foreach (const LinkEntity &link, getLinkEntities()) {
+            Okular::Action *okularAction = nullptr;
+            if (link.targetPage != -1) { // internal link
+                Okular::DocumentViewport viewport(link.targetPage);
+                if (!link.targetPosition.isNull()) {
+                    viewport.rePos.pos = Okular::DocumentViewport::TopLeft;
+                    viewport.rePos.normalizedX = link.targetPosition.x();
+                    viewport.rePos.normalizedY = link.targetPosition.y();
+                    viewport.rePos.enabled = true;
                 }
+                okularAction = new Okular::GotoAction(link.uri, viewport);
+            }
+            else if (!link.uri.isNull()) { // external link
+                okularAction = new Okular::BrowseAction(QUrl(link.uri));
+            }
+
+            if (okularAction) {
+                Okular::ObjectRect *rect = new Okular::ObjectRect(
+                            link.boundary.left(), link.boundary.top(), link.boundary.right(), link.boundary.bottom(), 
+                            false, 
+                            Okular::ObjectRect::Action, 
+                            okularAction);
+                links.push_back(rect);
             }
         }
-        
         return links;
     }
 
@@ -331,15 +602,23 @@ public:
     Okular::Rotation orientation {Okular::Rotation0};
     int numChars {-1};
     int numRects {-1};
-    QImage cachedImage;
-    QList<CharEntity*> charEntityList;
-    QLinkedList<Okular::ObjectRect*> links;
-    bool isHasLinks {false};
+    int objectCount {0};
+    TextLayout textLayout;
+    bool textLayoutReady {false};
+    QVector<LinkEntity> linkEntities;
+    bool linksReady {false};
+    bool orientationReady {false};
+    TextCache *textCache {nullptr};
+    FPDF_FORMHANDLE form {nullptr};
+    bool textCacheChecked {false};
+    bool textCacheHit {false};
     QMutex mutex;
+    // What memoryUsage() found the last time the page wasn't busy
+    QAtomicInteger<qint64> lastMemoryUsage {sizeof(PagePrivate)};
 };
 
-Page::Page(FPDF_DOCUMENT pdfdoc, int pageNumber, const QSizeF &dpi)
-  : d(new PagePrivate(pdfdoc, pageNumber, dpi))
+Page::Page(FPDF_DOCUMENT pdfdoc, int pageNumber, const QSizeF &dpi, TextCache *textCache, FPDF_FORMHANDLE form)
+  : d(new PagePrivate(pdfdoc, pageNumber, dpi, textCache, form))
 {
 }
 
@@ -384,6 +663,7 @@ int Page::pageNumber() const
 
 Okular::Rotation Page::orientation() const
 {
+    QMutexLocker locker(&d->mutex);
     return d->getOrientation();
 }
 
@@ -401,29 +681,96 @@ int Page::numRects() const
     return d->numRects;
 }
 
-QImage Page::image(const int &width, const int &height)
+QImage Page::image(const int &width, const int &height, int renderFlags,
+                   PartialUpdateCallback partialUpdateCallback,
+                   ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                   ShouldAbortRenderCallback shouldAbortRenderCallback,
+                   const QVariant &payload)
+{
+    QMutexLocker locker(&d->mutex);
+    return d->image(width, height, renderFlags, partialUpdateCallback, shouldDoPartialUpdateCallback, shouldAbortRenderCallback, payload);
+}
+
+QImage Page::renderToImage(float dpiX, float dpiY, int x, int y, int width, int height, int renderFlags,
+                           PartialUpdateCallback partialUpdateCallback,
+                           ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                           ShouldAbortRenderCallback shouldAbortRenderCallback,
+                           const QVariant &payload)
 {
     QMutexLocker locker(&d->mutex);
-    return d->image(width, height);
+    return d->renderToImage(dpiX, dpiY, x, y, width, height, renderFlags,
+                            partialUpdateCallback, shouldDoPartialUpdateCallback, shouldAbortRenderCallback, payload);
 }
 
-QImage Page::renderToImage(float dpiX, float dpiY, int x, int y, int width, int height, Okular::Rotation rotation)
+TextLayout Page::textLayout() const
 {
     QMutexLocker locker(&d->mutex);
-    return d->renderToImage(dpiX, dpiY, x, y, width, height, rotation);
+    return d->getTextLayout();
 }
 
-QList<CharEntity*> Page::charEntityList() const
+bool Page::prefetchTextLayout()
 {
     QMutexLocker locker(&d->mutex);
-    return d->getCharEntityList();
+    return d->prefetchTextLayout();
+}
+
+QImage Page::drawOverlay(const QImage &content, int startX, int startY, int sizeX, int sizeY, int renderFlags)
+{
+    QMutexLocker locker(&d->mutex);
+    return d->drawOverlay(content, startX, startY, sizeX, sizeY, renderFlags);
+}
+
+QImage Page::embeddedThumbnail(int width, int height) const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->getEmbeddedThumbnail(width, height);
+}
+
+qint64 Page::memoryUsage() const
+{
+    // A page being rendered holds its mutex for the whole render, don't wait for it
+    if (!d->mutex.tryLock())
+        return d->lastMemoryUsage.loadAcquire();
+    const qint64 bytes = d->memoryUsage();
+    d->lastMemoryUsage.storeRelease(bytes);
+    d->mutex.unlock();
+    return bytes;
+}
+
+bool Page::releasePdfiumState()
+{
+    if (!d->mutex.tryLock())
+        return false;
+    d->closeTextPage();
+    d->closePage();
+    d->mutex.unlock();
+    return true;
+}
+
+PageCounters Page::counters()
+{
+    PageCounters counters;
+    counters.pagesLoaded = pagesLoaded.loadAcquire();
+    counters.pagesClosed = pagesClosed.loadAcquire();
+    counters.textPagesLoaded = textPagesLoaded.loadAcquire();
+    counters.textPagesClosed = textPagesClosed.loadAcquire();
+    counters.textLayoutsExtracted = textLayoutsExtracted.loadAcquire();
+    counters.linkListsExtracted = linkListsExtracted.loadAcquire();
+    return counters;
 }
 
 bool Page::hasLinks()
 {
+    QMutexLocker locker(&d->mutex);
     return d->hasLinks();
 }
 
+QVector<LinkEntity> Page::linkEntities() const
+{
+    QMutexLocker locker(&d->mutex);
+    return d->getLinkEntities();
+}
+
 QLinkedList<Okular::ObjectRect*> Page::links() const
 {
     QMutexLocker locker(&d->mutex);
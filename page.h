@@ -11,10 +11,16 @@
 #define QPDFIUM_PAGE_H
 
 #include <pdfium/fpdf_doc.h>
+#include <pdfium/fpdfview.h>
 
 #include <QSharedPointer>
 #include <QString>
 #include <QList>
+#include <QPointF>
+#include <QRectF>
+#include <QVector>
+#include <QVariant>
+#include <QImage>
 
 #include <okular/core/document.h>
 
@@ -26,17 +32,78 @@ class DocumentViewport;
 
 namespace QPdfium {
 
-struct CharEntity
+// Render flags used for the pixmaps handed to Okular
+const int DefaultRenderFlags = FPDF_ANNOT | FPDF_LCD_TEXT;
+// Without anti-aliasing, for pixmaps that only have to be quick
+const int DraftRenderFlags = FPDF_ANNOT | FPDF_RENDER_NO_SMOOTHTEXT | FPDF_RENDER_NO_SMOOTHIMAGE | FPDF_RENDER_NO_SMOOTHPATH;
+const int ThumbnailRenderFlags = DraftRenderFlags;
+
+// Quality a pixmap request is rendered at
+enum RenderTier {
+    FullTier,           // the final pixmap of the view
+    DraftTier,          // shown while the view is still moving, replaced once it settles
+    ThumbnailTier       // small pixmaps, e.g. of the sidebar
+};
+
+inline int RenderFlagsForTier(RenderTier tier)
+{
+    switch (tier) {
+    case DraftTier:     return DraftRenderFlags;
+    case ThumbnailTier: return ThumbnailRenderFlags;
+    default:            return DefaultRenderFlags;
+    }
+}
+
+// Receives the partially drawn image while a progressive render is running
+typedef void (*PartialUpdateCallback)(const QImage &image, const QVariant &payload);
+// Polled while rendering, returning true delivers the current image to the PartialUpdateCallback
+typedef bool (*ShouldDoPartialUpdateCallback)(const QVariant &payload);
+// Polled while rendering, returning true stops the render and discards the image
+typedef bool (*ShouldAbortRenderCallback)(const QVariant &payload);
+
+// Characters of a page and their boxes in page pixels at 72 dpi, kept in flat arrays
+struct TextLayout
 {
-    QString str;
-    QRect area;
+    QVector<uint> unicode;      // UTF-32, one entry per character
+    QVector<float> boxes;       // left, top, right, bottom of each character
+
+    int count() const { return unicode.count(); }
+    bool isEmpty() const { return unicode.isEmpty(); }
+    QString text(int index) const { return QString::fromUcs4(&unicode.at(index), 1); }
+    QRectF box(int index) const
+    {
+        const float *b = boxes.constData() + index * 4;
+        return QRectF(QPointF(b[0], b[1]), QPointF(b[2], b[3]));
+    }
 };
 
+// A link of a page, independent of the Okular objects it ends up as
+struct LinkEntity
+{
+    QRectF boundary;            // normalized to the page size
+    int targetPage {-1};        // -1 for external links
+    QPointF targetPosition;     // normalized, null when the destination has no location
+    QString uri;
+};
+
+// What the pages of all documents did so far
+struct PageCounters
+{
+    quint64 pagesLoaded {0};
+    quint64 pagesClosed {0};
+    quint64 textPagesLoaded {0};
+    quint64 textPagesClosed {0};
+    quint64 textLayoutsExtracted {0};   // not counting the ones read from the text cache
+    quint64 linkListsExtracted {0};
+};
+
+class TextCache;
 class PagePrivate;
 class Page
 {
 public:
-    Page(FPDF_DOCUMENT pdfdoc, int pageNumber, const QSizeF &dpi);
+    Page(FPDF_DOCUMENT pdfdoc, int pageNumber, const QSizeF &dpi, TextCache *textCache = nullptr,
+         FPDF_FORMHANDLE form = nullptr);
     ~Page();
 
     FPDF_PAGE getPdfPage();
@@ -50,11 +117,35 @@ public:
     Okular::Rotation orientation() const;
     int numChars() const;
     int numRects() const;
-    QList<CharEntity*> charEntityList() const;
+    TextLayout textLayout() const;
+    // Loads the text layout unless that has to wait for the text cache, returns false then
+    bool prefetchTextLayout();
     bool hasLinks();
+    QVector<LinkEntity> linkEntities() const;
     QLinkedList<Okular::ObjectRect*> links() const;
-    QImage image(const int &width, const int &height);
-    QImage renderToImage(float dpiX, float dpiY, int x, int y, int width, int height, Okular::Rotation rotation);
+    QImage image(const int &width, const int &height, int renderFlags = DefaultRenderFlags,
+                 PartialUpdateCallback partialUpdateCallback = nullptr,
+                 ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback = nullptr,
+                 ShouldAbortRenderCallback shouldAbortRenderCallback = nullptr,
+                 const QVariant &payload = QVariant());
+    QImage renderToImage(float dpiX, float dpiY, int x, int y, int width, int height,
+                         int renderFlags = DefaultRenderFlags,
+                         PartialUpdateCallback partialUpdateCallback = nullptr,
+                         ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback = nullptr,
+                         ShouldAbortRenderCallback shouldAbortRenderCallback = nullptr,
+                         const QVariant &payload = QVariant());
+    // Returns a copy of content with the form fields of the page drawn over it, content is a
+    // window at (-startX, -startY) into the page rendered at sizeX x sizeY. Needs a form handle.
+    QImage drawOverlay(const QImage &content, int startX, int startY, int sizeX, int sizeY, int renderFlags);
+    QImage embeddedThumbnail(int width, int height) const;
+    // An estimate; a page that is busy answers with its last one
+    qint64 memoryUsage() const;
+    // Closes the PDFium page and text page, which are reloaded when needed again.
+    // Leaves the form fill environment too, so call it with the user mutex held.
+    // Returns false when the page is busy.
+    bool releasePdfiumState();
+
+    static PageCounters counters();
 
 private:
     QSharedPointer<PagePrivate> d;
@@ -0,0 +1,274 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+/*
+ * pdfium-backend-bench, times the QPdfium layer over a set of PDF files:
+ *
+ *   pdfium-backend-bench [--iterations N] [--pages N] [--dpi 72,150,300]
+ *                        [--tile 512] [--output result.json] <directory or file>...
+ *
+ * Every iteration opens each document again, so nothing is served from the
+ * page cache of the previous one. The disk text cache is off unless
+ * OKULAR_PDFIUM_TEXT_CACHE_MB is set. Durations are reported in milliseconds
+ * as percentiles per operation, for each file and for the whole run, with the
+ * peak resident memory of the process.
+ */
+
+#include <pdfium/fpdfview.h>
+#include <pdfium/fpdf_doc.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QScopedPointer>
+#include <QStringList>
+#include <QVector>
+
+#include <algorithm>
+#include <cstdio>
+
+#include "pdfium_utils.h"
+#include "bench_stats.h"
+#include "document.h"
+#include "font_info.h"
+#include "page.h"
+
+// Walks the outline the way the generator builds its synopsis, returns the number of entries
+static int walkBookmarks(FPDF_DOCUMENT pdfdoc, FPDF_BOOKMARK parent)
+{
+    int count = 0;
+    FPDF_BOOKMARK bookmark = FPDFBookmark_GetFirstChild(pdfdoc, parent);
+    while (bookmark) {
+        const QString title = QPdfium::GetBookmarkTitle(bookmark);
+        Q_UNUSED(title)
+        if (FPDF_DEST dest = FPDFBookmark_GetDest(pdfdoc, bookmark)) {
+            FPDFDest_GetDestPageIndex(pdfdoc, dest);
+            QPdfium::GetLocationInPage(dest);
+        }
+        count += 1 + walkBookmarks(pdfdoc, bookmark);
+        bookmark = FPDFBookmark_GetNextSibling(pdfdoc, bookmark);
+    }
+    return count;
+}
+
+class Bench
+{
+public:
+    int iterations {3};
+    int pagesPerDocument {10};
+    QVector<int> dpis {72, 150, 300};
+    int tileSize {512};
+
+    bool run(const QString &filePath, Samples &samples, QJsonObject &info)
+    {
+        for (int iteration = 0; iteration < iterations; ++iteration) {
+            QElapsedTimer timer;
+            timer.start();
+            QScopedPointer<QPdfium::Document> doc(QPdfium::Document::load(filePath));
+            const int pageCount = doc->pdfdoc() ? doc->pagesCount() : -1;
+            samples[QStringLiteral("open")] << timer.nsecsElapsed();
+            if (pageCount < 0 || doc->isLocked()) {
+                info[QStringLiteral("error")] = doc->isLocked() ? QStringLiteral("locked")
+                                                                : QStringLiteral("open failed");
+                return false;
+            }
+            info[QStringLiteral("pages")] = pageCount;
+
+            // What loadPages() does before the first paint, sizes and labels of every page
+            timer.restart();
+            for (int pageNumber = 0; pageNumber < pageCount; ++pageNumber) {
+                doc->pageSize(pageNumber);
+                QPdfium::GetPageLabel(doc->pdfdoc(), pageNumber);
+            }
+            samples[QStringLiteral("page_setup")] << timer.nsecsElapsed();
+
+            // Pages spread over the document
+            const int sampled = qMin(pageCount, pagesPerDocument);
+            for (int i = 0; i < sampled; ++i) {
+                const int pageNumber = sampled > 1 ? qint64(i) * (pageCount - 1) / (sampled - 1) : 0;
+                measurePage(doc.data(), pageNumber, samples);
+            }
+
+            timer.restart();
+            const int entries = walkBookmarks(doc->pdfdoc(), nullptr);
+            samples[QStringLiteral("toc")] << timer.nsecsElapsed();
+            info[QStringLiteral("toc_entries")] = entries;
+
+            timer.restart();
+            doc.reset();
+            samples[QStringLiteral("close")] << timer.nsecsElapsed();
+        }
+        return true;
+    }
+
+private:
+    void measurePage(QPdfium::Document *doc, int pageNumber, Samples &samples)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        QPdfium::PagePtr page = doc->page(pageNumber);
+        if (!page || !page->getPdfPage())
+            return;
+        samples[QStringLiteral("page_load")] << timer.nsecsElapsed();
+
+        const QSizeF size = doc->pageSize(pageNumber);
+        for (int dpi : qAsConst(dpis)) {
+            const int width = qMax(1, qRound(size.width() * dpi / 72.0));
+            const int height = qMax(1, qRound(size.height() * dpi / 72.0));
+            timer.restart();
+            page->renderToImage(dpi, dpi, 0, 0, width, height);
+            samples[QStringLiteral("render_%1dpi").arg(dpi)] << timer.nsecsElapsed();
+        }
+
+        // A tile from the middle of the page at the highest resolution, as zoomed in views request
+        if (tileSize > 0 && !dpis.isEmpty()) {
+            const int dpi = *std::max_element(dpis.constBegin(), dpis.constEnd());
+            const int width = qRound(size.width() * dpi / 72.0);
+            const int height = qRound(size.height() * dpi / 72.0);
+            const int tileWidth = qMin(tileSize, width);
+            const int tileHeight = qMin(tileSize, height);
+            timer.restart();
+            page->renderToImage(dpi, dpi, (width - tileWidth) / 2, (height - tileHeight) / 2,
+                                tileWidth, tileHeight);
+            samples[QStringLiteral("render_tile")] << timer.nsecsElapsed();
+        }
+
+        timer.restart();
+        page->textLayout();
+        samples[QStringLiteral("text")] << timer.nsecsElapsed();
+
+        timer.restart();
+        page->linkEntities();
+        samples[QStringLiteral("links")] << timer.nsecsElapsed();
+    }
+};
+
+static QStringList collectFiles(const QStringList &paths)
+{
+    QStringList files;
+    for (const QString &path : paths) {
+        if (QFileInfo(path).isDir()) {
+            QDirIterator it(path, {QStringLiteral("*.pdf"), QStringLiteral("*.PDF")}, QDir::Files,
+                            QDirIterator::Subdirectories);
+            QStringList found;
+            while (it.hasNext())
+                found << it.next();
+            found.sort();
+            files << found;
+        }
+        else {
+            files << path;
+        }
+    }
+    return files;
+}
+
+int main(int argc, char **argv)
+{
+    // Extraction is what's measured, not reads from a cache filled by a previous run
+    if (!qEnvironmentVariableIsSet("OKULAR_PDFIUM_TEXT_CACHE_MB"))
+        qputenv("OKULAR_PDFIUM_TEXT_CACHE_MB", "0");
+
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("pdfium-backend-bench"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Times the QPdfium layer of the Okular PDFium backend"));
+    parser.addHelpOption();
+    QCommandLineOption iterationsOption(QStringLiteral("iterations"), QStringLiteral("Opens of each document."),
+                                        QStringLiteral("n"), QStringLiteral("3"));
+    QCommandLineOption pagesOption(QStringLiteral("pages"), QStringLiteral("Pages measured in each document."),
+                                   QStringLiteral("n"), QStringLiteral("10"));
+    QCommandLineOption dpiOption(QStringLiteral("dpi"), QStringLiteral("Comma separated full page render resolutions."),
+                                 QStringLiteral("list"), QStringLiteral("72,150,300"));
+    QCommandLineOption tileOption(QStringLiteral("tile"), QStringLiteral("Side of the rendered tile, 0 to skip tiles."),
+                                  QStringLiteral("pixels"), QStringLiteral("512"));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Writes the JSON there instead of stdout."),
+                                    QStringLiteral("file"));
+    parser.addOptions({iterationsOption, pagesOption, dpiOption, tileOption, outputOption});
+    parser.addPositionalArgument(QStringLiteral("paths"), QStringLiteral("PDF files or directories of them."),
+                                 QStringLiteral("<path>..."));
+    parser.process(app);
+
+    Bench bench;
+    bench.iterations = qMax(1, parser.value(iterationsOption).toInt());
+    bench.pagesPerDocument = qMax(1, parser.value(pagesOption).toInt());
+    bench.tileSize = qMax(0, parser.value(tileOption).toInt());
+    bench.dpis.clear();
+    for (const QString &dpi : parser.value(dpiOption).split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        if (dpi.toInt() > 0)
+            bench.dpis << dpi.toInt();
+    }
+
+    const QStringList files = collectFiles(parser.positionalArguments());
+    if (files.isEmpty())
+        parser.showHelp(1);
+
+    FPDF_LIBRARY_CONFIG config;
+    config.version = 2;
+    config.m_pUserFontPaths = nullptr;
+    config.m_pIsolate = nullptr;
+    config.m_v8EmbedderSlot = 0;
+    FPDF_InitLibraryWithConfig(&config);
+    if (FPDF_SYSFONTINFO *fontInfo = QPdfium::SystemFontInfo())
+        FPDF_SetSystemFontInfo(fontInfo);
+
+    Samples total;
+    QJsonArray documents;
+    int failures = 0;
+    for (const QString &file : files) {
+        Samples samples;
+        QJsonObject document;
+        document[QStringLiteral("file")] = file;
+        if (!bench.run(file, samples, document))
+            ++failures;
+        document[QStringLiteral("timings_ms")] = summarize(samples);
+        document[QStringLiteral("peak_rss_kb")] = peakRssKb();
+        documents.append(document);
+        merge(total, samples);
+    }
+
+    FPDF_DestroyLibrary();
+
+    QJsonArray dpis;
+    for (int dpi : qAsConst(bench.dpis))
+        dpis.append(dpi);
+    QJsonObject settings;
+    settings[QStringLiteral("iterations")] = bench.iterations;
+    settings[QStringLiteral("pages")] = bench.pagesPerDocument;
+    settings[QStringLiteral("dpi")] = dpis;
+    settings[QStringLiteral("tile")] = bench.tileSize;
+
+    QJsonObject result;
+    result[QStringLiteral("settings")] = settings;
+    result[QStringLiteral("documents")] = documents;
+    result[QStringLiteral("failures")] = failures;
+    result[QStringLiteral("timings_ms")] = summarize(total);
+    result[QStringLiteral("peak_rss_kb")] = peakRssKb();
+
+    const QByteArray json = QJsonDocument(result).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile output(parser.value(outputOption));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qWarning("Can't write %s", qPrintable(output.fileName()));
+            return 1;
+        }
+        output.write(json);
+    }
+    else {
+        fwrite(json.constData(), 1, json.size(), stdout);
+    }
+    return failures ? 2 : 0;
+}
@@ -0,0 +1,340 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+/*
+ * pdfium-backend-replay, plays a trace written with OKULAR_PDFIUM_RECORD_DIR
+ * back against the generator:
+ *
+ *   pdfium-backend-replay [--document file.pdf] [--speed 1] [--settle 3000]
+ *                         [--output result.json] trace.jsonl
+ *
+ * The requests go through a headless Okular::Document the way the page view
+ * sends them, so Okular's queueing and cancelling is part of the replay.
+ * Requests recorded within a few milliseconds of each other were one batch
+ * of the view and are sent together. A batch replaces the previous ones, as
+ * a scroll or a zoom does, only when the trace shows one of their requests
+ * aborted while it was current. The generator plugin next to the executable
+ * is used when there is one, the installed one otherwise.
+ */
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLinkedList>
+#include <QMimeDatabase>
+#include <QTimer>
+#include <QUrl>
+#include <QVector>
+
+#include <cstdio>
+
+#include <okular/core/area.h>
+#include <okular/core/document.h>
+#include <okular/core/generator.h>
+#include <okular/core/observer.h>
+#ifdef HAVE_OKULAR_SETTINGS_CORE
+#include <okular/core/settings_core.h>
+#endif
+
+#include "bench_stats.h"
+
+// Pixmap requests closer than this to the previous one were sent in the same batch
+static const double batchGap = 2.0;
+
+struct TraceEvent
+{
+    double time;        // milliseconds since the document was opened
+    QJsonObject json;
+};
+
+struct ReplayBatch
+{
+    double time;
+    QLinkedList<QJsonObject> requests;
+    bool removesPrevious {false};
+};
+
+// Times pixmap requests from their batch being sent until their page gets the pixmap
+class ReplayObserver : public Okular::DocumentObserver
+{
+public:
+    void submitted(int pageNumber, int batch)
+    {
+        pending[pageNumber].append({ clock.nsecsElapsed(), batch });
+        ++requested;
+        lastActivity.start();
+    }
+
+    void notifyPageChanged(int page, int flags) override
+    {
+        if (!(flags & Okular::DocumentObserver::Pixmap))
+            return;
+        QList<Pending> &queue = pending[page];
+        if (queue.isEmpty())
+            return;
+        // Requests of older batches for the page were replaced, the pixmap is for the newest
+        const int newest = queue.last().batch;
+        while (queue.first().batch < newest)
+            queue.removeFirst();
+        samples[QStringLiteral("pixmap")] << clock.nsecsElapsed() - queue.takeFirst().submitted;
+        ++delivered;
+        lastActivity.start();
+    }
+
+    bool hasPending() const
+    {
+        for (const QList<Pending> &queue : pending) {
+            if (!queue.isEmpty())
+                return true;
+        }
+        return false;
+    }
+
+    struct Pending
+    {
+        qint64 submitted;
+        int batch;
+    };
+
+    QElapsedTimer clock;
+    QElapsedTimer lastActivity;     // since the last request sent or pixmap delivered
+    QHash<int, QList<Pending>> pending;
+    Samples samples;
+    int requested {0};
+    int delivered {0};
+};
+
+static QVector<TraceEvent> loadTrace(const QString &path, QString *documentPath)
+{
+    QVector<TraceEvent> events;
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return events;
+    while (!file.atEnd()) {
+        const QJsonObject json = QJsonDocument::fromJson(file.readLine()).object();
+        if (json.isEmpty())
+            continue;
+        if (json.value(QStringLiteral("event")).toString() == QLatin1String("open") && documentPath->isEmpty())
+            *documentPath = json.value(QStringLiteral("file")).toString();
+        events.append({ json.value(QStringLiteral("t")).toDouble(), json });
+    }
+    return events;
+}
+
+// Durations the generator took when the trace was recorded
+static QJsonObject recordedSummary(const QVector<TraceEvent> &events)
+{
+    Samples samples;
+    QHash<QString, int> counts;
+    for (const TraceEvent &event : events) {
+        const QString type = event.json.value(QStringLiteral("event")).toString();
+        counts[type] += 1;
+        if (event.json.contains(QStringLiteral("ms")))
+            samples[type] << qint64(event.json.value(QStringLiteral("ms")).toDouble() * 1e6);
+    }
+
+    QJsonObject result;
+    result[QStringLiteral("pixmaps")] = counts.value(QStringLiteral("pixmap"));
+    result[QStringLiteral("aborts")] = counts.value(QStringLiteral("abort"));
+    result[QStringLiteral("texts")] = counts.value(QStringLiteral("text"));
+    result[QStringLiteral("duration_s")] = events.isEmpty() ? 0.0 : events.last().time / 1000.0;
+    result[QStringLiteral("timings_ms")] = summarize(samples);
+    return result;
+}
+
+static Okular::PixmapRequest *pixmapRequest(ReplayObserver *observer, const QJsonObject &json)
+{
+    Okular::PixmapRequest::PixmapRequestFeatures features = Okular::PixmapRequest::NoFeature;
+    if (json.value(QStringLiteral("asynchronous")).toBool())
+        features |= Okular::PixmapRequest::Asynchronous;
+    if (json.value(QStringLiteral("preload")).toBool())
+        features |= Okular::PixmapRequest::Preload;
+
+    auto request = new Okular::PixmapRequest(observer, json.value(QStringLiteral("page")).toInt(),
+                                             json.value(QStringLiteral("width")).toInt(),
+                                             json.value(QStringLiteral("height")).toInt(),
+                                             json.value(QStringLiteral("priority")).toInt(), features);
+    if (json.value(QStringLiteral("tile")).toBool()) {
+        const QJsonArray rect = json.value(QStringLiteral("rect")).toArray();
+        request->setTile(true);
+        request->setNormalizedRect(Okular::NormalizedRect(rect.at(0).toDouble(), rect.at(1).toDouble(),
+                                                          rect.at(2).toDouble(), rect.at(3).toDouble()));
+    }
+    request->setPartialUpdatesWanted(json.value(QStringLiteral("partial")).toBool());
+    return request;
+}
+
+int main(int argc, char **argv)
+{
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("pdfium-backend-replay"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Plays a recorded request trace back against the PDFium generator"));
+    parser.addHelpOption();
+    QCommandLineOption documentOption(QStringLiteral("document"), QStringLiteral("The PDF, instead of the recorded path."),
+                                      QStringLiteral("file"));
+    QCommandLineOption speedOption(QStringLiteral("speed"), QStringLiteral("Playback speed, 2 sends the requests twice as fast."),
+                                   QStringLiteral("factor"), QStringLiteral("1"));
+    QCommandLineOption settleOption(QStringLiteral("settle"), QStringLiteral("Wait for outstanding pixmaps after the last request."),
+                                    QStringLiteral("ms"), QStringLiteral("3000"));
+    QCommandLineOption outputOption(QStringLiteral("output"), QStringLiteral("Writes the JSON there instead of stdout."),
+                                    QStringLiteral("file"));
+    parser.addOptions({documentOption, speedOption, settleOption, outputOption});
+    parser.addPositionalArgument(QStringLiteral("trace"), QStringLiteral("Trace written with OKULAR_PDFIUM_RECORD_DIR."));
+    parser.process(app);
+
+    if (parser.positionalArguments().count() != 1)
+        parser.showHelp(1);
+    const QString tracePath = parser.positionalArguments().first();
+    const double speed = parser.value(speedOption).toDouble() > 0 ? parser.value(speedOption).toDouble() : 1.0;
+    const int settle = qMax(0, parser.value(settleOption).toInt());
+
+    QString documentPath = parser.value(documentOption);
+    const QVector<TraceEvent> events = loadTrace(tracePath, &documentPath);
+    if (events.isEmpty() || documentPath.isEmpty()) {
+        qWarning("No requests or no document in %s", qPrintable(tracePath));
+        return 1;
+    }
+
+    // Prefer the generator that was built with this executable
+    if (QDir(QCoreApplication::applicationDirPath()).exists(QStringLiteral("okular/generators")))
+        QCoreApplication::setLibraryPaths({ QCoreApplication::applicationDirPath() });
+
+#ifdef HAVE_OKULAR_SETTINGS_CORE
+    Okular::SettingsCore::instance(QStringLiteral("okularproviderrc"));
+#endif
+    Okular::Document document(nullptr);
+    ReplayObserver observer;
+    document.addObserver(&observer);
+    const QMimeType mime = QMimeDatabase().mimeTypeForFile(documentPath);
+    if (document.openDocument(documentPath, QUrl::fromLocalFile(documentPath), mime) != Okular::Document::OpenSuccess) {
+        qWarning("Can't open %s", qPrintable(documentPath));
+        return 1;
+    }
+    const int pagesCount = int(document.pages());
+
+    // Groups the pixmap requests into the batches the view sent
+    QVector<ReplayBatch*> batches;
+    QHash<qint64, int> batchOfRequest;
+    QVector<TraceEvent> aborts;
+    double lastPixmapTime = -1.0;
+    ReplayBatch *batch = nullptr;
+    double lastEventTime = 0.0;
+    observer.clock.start();
+    for (const TraceEvent &event : events) {
+        const QString type = event.json.value(QStringLiteral("event")).toString();
+        const int pageNumber = event.json.value(QStringLiteral("page")).toInt(-1);
+        if (type == QLatin1String("abort"))
+            aborts.append(event);
+        if ((type != QLatin1String("pixmap") && type != QLatin1String("text")) ||
+            pageNumber < 0 || pageNumber >= pagesCount) {
+            batch = nullptr;
+            continue;
+        }
+        lastEventTime = event.time;
+        const int delay = int(event.time / speed);
+
+        if (type == QLatin1String("text")) {
+            batch = nullptr;
+            QTimer::singleShot(delay, &app, [&document, &observer, pageNumber] {
+                QElapsedTimer timer;
+                timer.start();
+                document.requestTextPage(pageNumber);
+                observer.samples[QStringLiteral("text")] << timer.nsecsElapsed();
+            });
+            continue;
+        }
+
+        if (!batch || event.time - lastPixmapTime > batchGap) {
+            batch = new ReplayBatch;
+            batch->time = event.time;
+            const int index = batches.count();
+            batches.append(batch);
+            QTimer::singleShot(delay, &app, [&document, &observer, batch, index] {
+                QLinkedList<Okular::PixmapRequest*> requests;
+                for (const QJsonObject &json : qAsConst(batch->requests)) {
+                    requests.append(pixmapRequest(&observer, json));
+                    observer.submitted(requests.last()->pageNumber(), index);
+                }
+                document.requestPixmaps(requests, batch->removesPrevious ? Okular::Document::RemoveAllPrevious
+                                                                         : Okular::Document::NoOption);
+            });
+        }
+        batch->requests.append(event.json);
+        batchOfRequest.insert(qint64(event.json.value(QStringLiteral("id")).toDouble()), batches.count() - 1);
+        lastPixmapTime = event.time;
+    }
+
+    // A request aborted while a later batch was current was replaced by that batch
+    for (const TraceEvent &abort : qAsConst(aborts)) {
+        const int aborted = batchOfRequest.value(qint64(abort.json.value(QStringLiteral("id")).toDouble()), -1);
+        int current = aborted;
+        while (current + 1 < batches.count() && batches.at(current + 1)->time <= abort.time)
+            ++current;
+        if (aborted >= 0 && current > aborted)
+            batches[current]->removesPrevious = true;
+    }
+
+    // Done once every pixmap arrived, or nothing happened for the settle time
+    QTimer done;
+    QObject::connect(&done, &QTimer::timeout, &app, [&] {
+        if (observer.clock.elapsed() < lastEventTime / speed)
+            return;
+        const bool settled = !observer.lastActivity.isValid() || observer.lastActivity.elapsed() >= settle;
+        if (!observer.hasPending() || settled)
+            app.quit();
+    });
+    done.start(100);
+    app.exec();
+    const double duration = observer.clock.nsecsElapsed() / 1e9;
+    document.closeDocument();
+    document.removeObserver(&observer);
+    qDeleteAll(batches);
+
+    QJsonObject replayed;
+    replayed[QStringLiteral("pixmaps")] = observer.requested;
+    replayed[QStringLiteral("delivered")] = observer.delivered;
+    replayed[QStringLiteral("not_delivered")] = observer.requested - observer.delivered;
+    replayed[QStringLiteral("batches")] = batches.count();
+    replayed[QStringLiteral("duration_s")] = duration;
+    replayed[QStringLiteral("pixmaps_per_second")] = duration > 0 ? observer.delivered / duration : 0.0;
+    replayed[QStringLiteral("timings_ms")] = summarize(observer.samples);
+
+    QJsonObject result;
+    result[QStringLiteral("trace")] = tracePath;
+    result[QStringLiteral("document")] = documentPath;
+    result[QStringLiteral("speed")] = speed;
+    result[QStringLiteral("recorded")] = recordedSummary(events);
+    result[QStringLiteral("replayed")] = replayed;
+    result[QStringLiteral("peak_rss_kb")] = peakRssKb();
+
+    const QByteArray json = QJsonDocument(result).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile output(parser.value(outputOption));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qWarning("Can't write %s", qPrintable(output.fileName()));
+            return 1;
+        }
+        output.write(json);
+    }
+    else {
+        fwrite(json.constData(), 1, json.size(), stdout);
+    }
+    return 0;
+}
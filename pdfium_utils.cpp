@@ -37,10 +37,14 @@ QDateTime pdfiumDateToQDateTime(const QString &textDate)
 
 QString GetPageLabel(FPDF_DOCUMENT pdfdoc, int pageNumber)
 {
+    // labelLength is in bytes and includes the UTF-16 terminator, decode straight into the QString
     const unsigned long labelLength = FPDF_GetPageLabel(pdfdoc, pageNumber, nullptr, 0);
-    QVector<ushort> buffer(labelLength);
-    FPDF_GetPageLabel(pdfdoc, pageNumber, buffer.data(), buffer.length());
-    return QString::fromUtf16(buffer.data());
+    if (labelLength <= sizeof(ushort))
+        return QString();
+    QString label(int(labelLength / sizeof(ushort)), Qt::Uninitialized);
+    FPDF_GetPageLabel(pdfdoc, pageNumber, label.data(), labelLength);
+    label.chop(1);
+    return label;
 }
 
 QSizeF GetPageSizeF(FPDF_DOCUMENT pdfdoc, int pageNumber)
@@ -63,30 +67,26 @@ QPointF GetLocationInPage(FPDF_DEST destination)
     return (hasX && hasY) ? QPointF(x, y) : QPointF();
 }
 
-QRectF FloatPageRectToPixelRect(FPDF_PAGE page, const QRectF &input)
+QTransform GetPageToDeviceTransform(FPDF_PAGE page)
 {
-    int outputWidth  = FPDF_GetPageWidth(page);
-    int outputHeight = FPDF_GetPageHeight(page);
-
-    FPDF_BOOL ret;
-    int min_x, min_y;
-    int max_x, max_y;
-    ret = FPDF_PageToDevice(page, 0, 0, outputWidth, outputHeight, 0, input.x(), input.y(), &min_x, &min_y);
-    if (!ret)
-        return QRectF();
-    ret = FPDF_PageToDevice(page, 0, 0, outputWidth, outputHeight, 0, input.right(), input.bottom(), &max_x, &max_y);
-    if (!ret)
-        return QRectF();
-
-    if (max_x < min_x)
-        std::swap(min_x, max_x);
-    if (max_y < min_y)
-        std::swap(min_y, max_y);
-
-    return QRectF(min_x, min_y, max_x - min_x, max_y - min_y);
+    // Page points to pixels at 72 dpi. FPDF_PageToDevice() rounds to whole device
+    // pixels so sample it on a scaled up device to keep the fraction
+    const int scale = 1024;
+    const int outputWidth  = int(FPDF_GetPageWidth(page)) * scale;
+    const int outputHeight = int(FPDF_GetPageHeight(page)) * scale;
+
+    int x0, y0, x1, y1, x2, y2;
+    FPDF_PageToDevice(page, 0, 0, outputWidth, outputHeight, 0, 0, 0, &x0, &y0);
+    FPDF_PageToDevice(page, 0, 0, outputWidth, outputHeight, 0, 1000, 0, &x1, &y1);
+    FPDF_PageToDevice(page, 0, 0, outputWidth, outputHeight, 0, 0, 1000, &x2, &y2);
+
+    const qreal unit = 1000.0 * scale;
+    return QTransform((x1 - x0) / unit, (y1 - y0) / unit,
+                      (x2 - x0) / unit, (y2 - y0) / unit,
+                      qreal(x0) / scale, qreal(y0) / scale);
 }
 
-QRectF GetFloatCharRectInPixels(FPDF_PAGE page, FPDF_TEXTPAGE textPage, int index)
+QRectF GetFloatCharRect(FPDF_TEXTPAGE textPage, int index)
 {
     double left, right, bottom, top;
     double ls_left, ls_right, ls_bottom, ls_top;
@@ -105,7 +105,7 @@ QRectF GetFloatCharRectInPixels(FPDF_PAGE page, FPDF_TEXTPAGE textPage, int inde
     //top  = qMin(lsRect.top(), ls_top);
     //left  -= (delta / 1.f);
     right += lsRect.width();
-    return FloatPageRectToPixelRect(page, QRectF(left, top, right - left, bottom - top));
+    return QRectF(left, top, right - left, bottom - top);
 }
 
 bool isWhiteSpace(const QString &str)
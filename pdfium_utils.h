@@ -19,6 +19,7 @@
 #include <QRectF>
 #include <QFile>
 #include <QDateTime>
+#include <QTransform>
 
 namespace QPdfium {
 
@@ -45,8 +46,8 @@ namespace QPdfium {
     QString GetPageLabel(FPDF_DOCUMENT pdfdoc, int pageNumber);
     QSizeF GetPageSizeF(FPDF_DOCUMENT pdfdoc, int pageNumber);
     QPointF GetLocationInPage(FPDF_DEST destination);
-    QRectF FloatPageRectToPixelRect(FPDF_PAGE page, const QRectF &input);
-    QRectF GetFloatCharRectInPixels(FPDF_PAGE page, FPDF_TEXTPAGE textPage, int index);
+    QTransform GetPageToDeviceTransform(FPDF_PAGE page);
+    QRectF GetFloatCharRect(FPDF_TEXTPAGE textPage, int index);
     QString GetBookmarkTitle(FPDF_BOOKMARK bookmark);
 }
 
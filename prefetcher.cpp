@@ -0,0 +1,179 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QMutexLocker>
+#include <QVariant>
+#include <QtGlobal>
+
+#include "document.h"
+#include "page.h"
+#include "prefetcher.h"
+#include "render_service.h"
+
+namespace QPdfium {
+
+// The generator has to be quiet for this long, in ms, before prefetching starts
+static const qint64 idleDelay = 150;
+
+Prefetcher::Prefetcher(Document *doc, QMutex *userMutex, RenderCache *renderCache)
+  : doc(doc),
+    userMutex(userMutex),
+    renderCache(renderCache)
+{
+    bool ok = false;
+    const int megabytes = qEnvironmentVariableIntValue("OKULAR_PDFIUM_PREFETCH_MB", &ok);
+    maxPixmapBytes = (ok && megabytes >= 0) ? qint64(megabytes) * 1024 * 1024 : 64 * 1024 * 1024;
+    sinceActivity.start();
+}
+
+Prefetcher::~Prefetcher()
+{
+    stop();
+}
+
+int Prefetcher::configuredPageCount()
+{
+    bool ok = false;
+    const int count = qEnvironmentVariableIntValue("OKULAR_PDFIUM_PREFETCH_PAGES", &ok);
+    return ok ? qMax(0, count) : 2;
+}
+
+void Prefetcher::schedule(const QList<PrefetchJob> &jobs)
+{
+    QMutexLocker locker(&mutex);
+    this->jobs = jobs;
+    pixmapBytes = 0;
+    sinceActivity.restart();
+    wakeUp.wakeAll();
+}
+
+void Prefetcher::yield()
+{
+    QMutexLocker locker(&mutex);
+    interrupted.storeRelease(1);
+    sinceActivity.restart();
+}
+
+void Prefetcher::stop()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopped = true;
+        jobs.clear();
+        interrupted.storeRelease(1);
+        wakeUp.wakeAll();
+    }
+    wait();
+}
+
+void Prefetcher::setMaxPixmapBytes(qint64 maxBytes)
+{
+    QMutexLocker locker(&mutex);
+    maxPixmapBytes = maxBytes;
+}
+
+quint64 Prefetcher::pagesPrefetched() const
+{
+    return pagesCount.loadAcquire();
+}
+
+quint64 Prefetcher::pixmapsPrefetched() const
+{
+    return pixmapsCount.loadAcquire();
+}
+
+void Prefetcher::run()
+{
+    PrefetchJob job;
+    while (takeJob(&job)) {
+        prefetch(job);
+    }
+}
+
+bool Prefetcher::takeJob(PrefetchJob *job)
+{
+    QMutexLocker locker(&mutex);
+    forever {
+        if (stopped)
+            return false;
+        if (jobs.isEmpty()) {
+            wakeUp.wait(&mutex);
+            continue;
+        }
+        const qint64 idleLeft = idleDelay - sinceActivity.elapsed();
+        if (idleLeft > 0) {
+            wakeUp.wait(&mutex, static_cast<unsigned long>(idleLeft));
+            continue;
+        }
+        *job = jobs.takeFirst();
+        interrupted.storeRelease(0);
+        return true;
+    }
+}
+
+void Prefetcher::prefetch(const PrefetchJob &job)
+{
+    // A busy user mutex means a request is being served, that one goes first
+    if (!userMutex->tryLock()) {
+        QMutexLocker locker(&mutex);
+        jobs.prepend(job);
+        sinceActivity.restart();
+        return;
+    }
+    {
+        RenderServiceLocker service(PrefetchPriority, shouldAbortCallback,
+                                    QVariant::fromValue(static_cast<void*>(this)));
+        if (service.isLocked())
+            prefetchLocked(job);
+    }
+    userMutex->unlock();
+}
+
+void Prefetcher::prefetchLocked(const PrefetchJob &job)
+{
+    PagePtr page = doc->page(job.pageNumber);
+    if (!page || interrupted.loadAcquire())
+        return;
+    page->getPdfPage();
+    // Text extraction can't be aborted once it runs, so it doesn't start while a request
+    // of this document or a more important one of another document is waiting
+    if (interrupted.loadAcquire() || RenderService::instance()->hasMoreImportantWaiter())
+        return;
+    if (!page->prefetchTextLayout())
+        return;
+    pagesCount.fetchAndAddRelaxed(1);
+
+    const RenderCacheKey &key = job.pixmapKey;
+    if (key.rect.isEmpty() || interrupted.loadAcquire() || renderCache->contains(key))
+        return;
+
+    const qint64 bytes = qint64(key.rect.width()) * key.rect.height() * 4;
+    {
+        QMutexLocker locker(&mutex);
+        if (pixmapBytes + bytes > maxPixmapBytes)
+            return;
+        pixmapBytes += bytes;
+    }
+
+    const QImage img = page->image(key.rect.width(), key.rect.height(), key.flags,
+                                   nullptr, nullptr, shouldAbortCallback,
+                                   QVariant::fromValue(static_cast<void*>(this)));
+    if (!img.isNull()) {
+        renderCache->insert(key, img);
+        pixmapsCount.fetchAndAddRelaxed(1);
+    }
+}
+
+bool Prefetcher::shouldAbortCallback(const QVariant &payload)
+{
+    auto prefetcher = static_cast<Prefetcher*>(payload.value<void*>());
+    return prefetcher->interrupted.loadAcquire();
+}
+
+}
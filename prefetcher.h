@@ -0,0 +1,92 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_PREFETCHER_H
+#define QPDFIUM_PREFETCHER_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "render_cache.h"
+
+namespace QPdfium {
+
+class Document;
+
+struct PrefetchJob
+{
+    int pageNumber {-1};
+    RenderCacheKey pixmapKey;   // a null rect when only the page and its text are wanted
+};
+
+/*
+ * Loads pages near the one being viewed while the generator is idle: the
+ * page handle, its text layout and, when asked to, a pixmap that goes into
+ * the render cache.
+ *
+ * Work only starts after the generator has been quiet for a moment, and
+ * yield() aborts the render in progress, so real requests never wait for
+ * more than a page load or the text extraction of one page. Text isn't
+ * extracted while a request is waiting or the text cache is busy. Pixmaps
+ * stop once OKULAR_PDFIUM_PREFETCH_MB worth of them have been rendered for
+ * the current position.
+ */
+class Prefetcher : public QThread
+{
+public:
+    Prefetcher(Document *doc, QMutex *userMutex, RenderCache *renderCache);
+    ~Prefetcher();
+
+    // Replaces the pending jobs
+    void schedule(const QList<PrefetchJob> &jobs);
+    // Called when a real request comes in
+    void yield();
+    void stop();
+    void setMaxPixmapBytes(qint64 maxBytes);
+
+    quint64 pagesPrefetched() const;
+    quint64 pixmapsPrefetched() const;
+
+    // Pages on each side of the viewed one, OKULAR_PDFIUM_PREFETCH_PAGES
+    static int configuredPageCount();
+
+protected:
+    void run() override;
+
+private:
+    bool takeJob(PrefetchJob *job);
+    void prefetch(const PrefetchJob &job);
+    void prefetchLocked(const PrefetchJob &job);
+    static bool shouldAbortCallback(const QVariant &payload);
+
+private:
+    Document *doc;
+    QMutex *userMutex;
+    RenderCache *renderCache;
+
+    QMutex mutex;
+    QWaitCondition wakeUp;
+    QList<PrefetchJob> jobs;
+    QElapsedTimer sinceActivity;
+    qint64 pixmapBytes {0};
+    qint64 maxPixmapBytes;
+    bool stopped {false};
+
+    QAtomicInt interrupted;
+    QAtomicInteger<quint64> pagesCount;
+    QAtomicInteger<quint64> pixmapsCount;
+};
+
+}
+
+#endif // QPDFIUM_PREFETCHER_H
@@ -0,0 +1,159 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QMutexLocker>
+#include <QtGlobal>
+
+#include "render_cache.h"
+
+namespace QPdfium {
+
+bool RenderCacheKey::operator==(const RenderCacheKey &other) const
+{
+    return pageNumber == other.pageNumber
+        && dpiX == other.dpiX
+        && dpiY == other.dpiY
+        && rect == other.rect
+        && flags == other.flags;
+}
+
+uint qHash(const RenderCacheKey &key, uint seed)
+{
+    uint h = ::qHash(key.pageNumber, seed);
+    h = h * 31 + ::qHash(key.dpiX);
+    h = h * 31 + ::qHash(key.dpiY);
+    h = h * 31 + ::qHash(key.rect.x()) + ::qHash(key.rect.y()) * 7;
+    h = h * 31 + ::qHash(key.rect.width()) + ::qHash(key.rect.height()) * 7;
+    h = h * 31 + ::qHash(key.flags);
+    return h;
+}
+
+RenderCache::RenderCache(qint64 maxBytes)
+  : maxBytesValue(maxBytes)
+{
+}
+
+qint64 RenderCache::defaultMaxBytes()
+{
+    bool ok = false;
+    const int megabytes = qEnvironmentVariableIntValue("OKULAR_PDFIUM_RENDER_CACHE_MB", &ok);
+    return (ok && megabytes >= 0) ? qint64(megabytes) * 1024 * 1024 : 128 * 1024 * 1024;
+}
+
+// Unlike find(), doesn't count as a hit or a miss
+bool RenderCache::contains(const RenderCacheKey &key) const
+{
+    QMutexLocker locker(&mutex);
+    return images.contains(key);
+}
+
+QImage RenderCache::find(const RenderCacheKey &key)
+{
+    QMutexLocker locker(&mutex);
+
+    auto it = images.constFind(key);
+    if (it != images.constEnd()) {
+        ++hitsCount;
+        lru.removeOne(key);
+        lru.prepend(key);
+        return it.value();
+    }
+
+    // A tile is cut from any region of the page that holds it
+    for (const RenderCacheKey &region : qAsConst(lru)) {
+        if (region.pageNumber == key.pageNumber && region.dpiX == key.dpiX && region.dpiY == key.dpiY
+            && region.flags == key.flags && region.rect.contains(key.rect)) {
+            const RenderCacheKey found = region;
+            ++hitsCount;
+            lru.removeOne(found);
+            lru.prepend(found);
+            return images.value(found).copy(key.rect.translated(-found.rect.topLeft()));
+        }
+    }
+
+    ++missesCount;
+    return QImage();
+}
+
+void RenderCache::insert(const RenderCacheKey &key, const QImage &image)
+{
+    if (image.isNull() || image.sizeInBytes() > maxBytesValue)
+        return;
+
+    QMutexLocker locker(&mutex);
+
+    auto it = images.find(key);
+    if (it != images.end()) {
+        bytesValue -= it.value().sizeInBytes();
+        it.value() = image;
+        lru.removeOne(key);
+    }
+    else {
+        images.insert(key, image);
+    }
+    bytesValue += image.sizeInBytes();
+    lru.prepend(key);
+    trim();
+}
+
+void RenderCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    images.clear();
+    lru.clear();
+    bytesValue = 0;
+}
+
+void RenderCache::setMaxBytes(qint64 maxBytes)
+{
+    QMutexLocker locker(&mutex);
+    maxBytesValue = maxBytes;
+    trim();
+}
+
+qint64 RenderCache::maxBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return maxBytesValue;
+}
+
+qint64 RenderCache::bytes() const
+{
+    QMutexLocker locker(&mutex);
+    return bytesValue;
+}
+
+quint64 RenderCache::hits() const
+{
+    QMutexLocker locker(&mutex);
+    return hitsCount;
+}
+
+quint64 RenderCache::misses() const
+{
+    QMutexLocker locker(&mutex);
+    return missesCount;
+}
+
+quint64 RenderCache::evictions() const
+{
+    QMutexLocker locker(&mutex);
+    return evictionsCount;
+}
+
+void RenderCache::trim()
+{
+    while (bytesValue > maxBytesValue && !lru.isEmpty()) {
+        const RenderCacheKey key = lru.takeLast();
+        bytesValue -= images.take(key).sizeInBytes();
+        ++evictionsCount;
+    }
+}
+
+}
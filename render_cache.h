@@ -0,0 +1,71 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_RENDER_CACHE_H
+#define QPDFIUM_RENDER_CACHE_H
+
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QRect>
+
+namespace QPdfium {
+
+struct RenderCacheKey
+{
+    int pageNumber {-1};
+    float dpiX {0.f};
+    float dpiY {0.f};
+    QRect rect;         // tile rect, or the whole image for full page renders
+    int flags {0};      // PDFium render flags
+
+    bool operator==(const RenderCacheKey &other) const;
+};
+
+uint qHash(const RenderCacheKey &key, uint seed = 0);
+
+class RenderCache
+{
+public:
+    explicit RenderCache(qint64 maxBytes = defaultMaxBytes());
+
+    // The image of key, or the part of a cached image of the same page that holds its rect
+    QImage find(const RenderCacheKey &key);
+    bool contains(const RenderCacheKey &key) const;
+    void insert(const RenderCacheKey &key, const QImage &image);
+    void clear();
+
+    void setMaxBytes(qint64 maxBytes);
+    qint64 maxBytes() const;
+    qint64 bytes() const;
+
+    quint64 hits() const;
+    quint64 misses() const;
+    quint64 evictions() const;
+
+    static qint64 defaultMaxBytes();
+
+private:
+    void trim();
+
+private:
+    mutable QMutex mutex;
+    QHash<RenderCacheKey, QImage> images;
+    QList<RenderCacheKey> lru;      // most recently used first
+    qint64 maxBytesValue;
+    qint64 bytesValue {0};
+    quint64 hitsCount {0};
+    quint64 missesCount {0};
+    quint64 evictionsCount {0};
+};
+
+}
+
+#endif // QPDFIUM_RENDER_CACHE_H
@@ -0,0 +1,148 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QGlobalStatic>
+#include <QMutexLocker>
+
+#include "render_service.h"
+
+namespace QPdfium {
+
+// How often waiters poll their abort callback, in ms
+static const unsigned long abortPollInterval = 20;
+
+Q_GLOBAL_STATIC(RenderService, renderService)
+
+RenderService *RenderService::instance()
+{
+    return renderService();
+}
+
+bool RenderService::isTurnOf(RenderPriority priority) const
+{
+    if (owner)
+        return false;
+    for (int p = 0; p < priority; ++p) {
+        if (waiting[p] > 0)
+            return false;
+    }
+    return true;
+}
+
+bool RenderService::acquire(RenderPriority priority, ShouldAbortRenderCallback shouldAbort, const QVariant &payload)
+{
+    QThread *self = QThread::currentThread();
+    QMutexLocker locker(&mutex);
+
+    if (owner == self) {
+        ++depth;
+        return true;
+    }
+
+    ++waiting[priority];
+    while (!isTurnOf(priority)) {
+        if (shouldAbort) {
+            // The callback may take locks of its own
+            locker.unlock();
+            const bool abort = shouldAbort(payload);
+            locker.relock();
+            if (abort) {
+                --waiting[priority];
+                // Lets others re-check whether it's their turn now
+                released.wakeAll();
+                return false;
+            }
+            released.wait(&mutex, abortPollInterval);
+        }
+        else {
+            released.wait(&mutex);
+        }
+    }
+    --waiting[priority];
+
+    owner = self;
+    depth = 1;
+    ownerPriority = priority;
+    return true;
+}
+
+bool RenderService::tryAcquire(RenderPriority priority)
+{
+    QThread *self = QThread::currentThread();
+    QMutexLocker locker(&mutex);
+
+    if (owner == self) {
+        ++depth;
+        return true;
+    }
+    if (!isTurnOf(priority))
+        return false;
+
+    owner = self;
+    depth = 1;
+    ownerPriority = priority;
+    return true;
+}
+
+void RenderService::release()
+{
+    QMutexLocker locker(&mutex);
+    Q_ASSERT(owner == QThread::currentThread());
+    if (--depth > 0)
+        return;
+    owner = nullptr;
+    released.wakeAll();
+}
+
+bool RenderService::moreImportantWaiting() const
+{
+    for (int p = 0; p < ownerPriority; ++p) {
+        if (waiting[p] > 0)
+            return true;
+    }
+    return false;
+}
+
+bool RenderService::hasMoreImportantWaiter() const
+{
+    QMutexLocker locker(&mutex);
+    return owner == QThread::currentThread() && moreImportantWaiting();
+}
+
+void RenderService::yield()
+{
+    QThread *self = QThread::currentThread();
+    QMutexLocker locker(&mutex);
+
+    if (owner != self || !moreImportantWaiting())
+        return;
+
+    const int savedDepth = depth;
+    const RenderPriority priority = ownerPriority;
+    ++yieldsCount;
+    owner = nullptr;
+    released.wakeAll();
+
+    ++waiting[priority];
+    while (!isTurnOf(priority))
+        released.wait(&mutex);
+    --waiting[priority];
+
+    owner = self;
+    depth = savedDepth;
+    ownerPriority = priority;
+}
+
+quint64 RenderService::yields() const
+{
+    QMutexLocker locker(&mutex);
+    return yieldsCount;
+}
+
+}
@@ -0,0 +1,100 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_RENDER_SERVICE_H
+#define QPDFIUM_RENDER_SERVICE_H
+
+#include <QMutex>
+#include <QThread>
+#include <QVariant>
+#include <QWaitCondition>
+
+#include "page.h"
+
+namespace QPdfium {
+
+// Most important first
+enum RenderPriority {
+    InteractivePriority,    // GUI thread calls: open, close, metadata, outline
+    VisiblePriority,        // whole page pixmaps and text of the view
+    TilePriority,
+    ThumbnailPriority,
+    PrefetchPriority,
+    RenderPriorityCount
+};
+
+/*
+ * PDFium isn't thread safe, and every open document has a generator thread
+ * of its own. All of them take turns through this gate, which lets the most
+ * important waiter in first, whatever document it belongs to.
+ *
+ * A progressive render pauses when hasMoreImportantWaiter() says so, and calls
+ * yield() once PDFium has returned, which hands PDFium to a more important
+ * waiter and waits for its next turn. A request that gets
+ * aborted while it waits is dropped without touching PDFium.
+ */
+class RenderService
+{
+public:
+    static RenderService *instance();
+
+    // Blocks until it's the turn of priority, returns false if shouldAbort says so first
+    bool acquire(RenderPriority priority,
+                 ShouldAbortRenderCallback shouldAbort = nullptr, const QVariant &payload = QVariant());
+    bool tryAcquire(RenderPriority priority);
+    void release();
+    // True on the holding thread when someone more important waits
+    bool hasMoreImportantWaiter() const;
+    // Gives way to more important waiters, only does something on the holding thread.
+    // Never call it from a PDFium callback, PDFium isn't re-entrant.
+    void yield();
+
+    quint64 yields() const;
+
+private:
+    bool isTurnOf(RenderPriority priority) const;
+    bool moreImportantWaiting() const;
+
+private:
+    mutable QMutex mutex;
+    QWaitCondition released;
+    int waiting[RenderPriorityCount] {};
+    QThread *owner {nullptr};
+    int depth {0};
+    RenderPriority ownerPriority {PrefetchPriority};
+    quint64 yieldsCount {0};
+};
+
+// Holds the render service for a scope
+class RenderServiceLocker
+{
+public:
+    explicit RenderServiceLocker(RenderPriority priority,
+                                 ShouldAbortRenderCallback shouldAbort = nullptr,
+                                 const QVariant &payload = QVariant())
+    {
+        locked = RenderService::instance()->acquire(priority, shouldAbort, payload);
+    }
+
+    ~RenderServiceLocker()
+    {
+        if (locked)
+            RenderService::instance()->release();
+    }
+
+    bool isLocked() const { return locked; }
+
+private:
+    Q_DISABLE_COPY(RenderServiceLocker)
+    bool locked;
+};
+
+}
+
+#endif // QPDFIUM_RENDER_SERVICE_H
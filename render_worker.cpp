@@ -0,0 +1,426 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QAtomicInt>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QVector>
+#include <QtGlobal>
+
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+#include "bitmap_pool.h"
+#include "render_worker.h"
+
+namespace QPdfium {
+
+#ifdef Q_OS_LINUX
+
+// Fd the shared memory buffer is handed to the helper on
+static const int sharedMemoryFd = 3;
+// A helper which doesn't answer within this time is considered dead
+static const int replyTimeout = 30000;
+// How often a request is checked for cancellation while its helpers render, in ms
+static const int abortPollInterval = 50;
+// The cancel flag lives at the end of the shared buffer, past the pixels
+static const qint64 controlBytes = 64;
+
+class RenderWorker
+{
+public:
+    enum Result { Done, Aborted, Failed };
+
+    ~RenderWorker()
+    {
+        stop();
+    }
+
+    bool start(const QString &executable)
+    {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
+            return false;
+
+        memfd = memfd_create("okular-pdfium-render", MFD_CLOEXEC);
+        if (memfd < 0) {
+            ::close(sockets[0]);
+            ::close(sockets[1]);
+            return false;
+        }
+        // dup2() onto the same fd wouldn't clear FD_CLOEXEC, keep the buffer clear of fd 3
+        if (memfd <= sharedMemoryFd) {
+            const int fd = fcntl(memfd, F_DUPFD_CLOEXEC, sharedMemoryFd + 1);
+            ::close(memfd);
+            memfd = fd;
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, sockets[1], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, sockets[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, memfd, sharedMemoryFd);
+
+        const QByteArray program = QFile::encodeName(executable);
+        char *argv[] = { const_cast<char*>(program.constData()), nullptr };
+        const int result = posix_spawn(&pid, program.constData(), &actions, nullptr, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+
+        ::close(sockets[1]);
+        socket = sockets[0];
+        if (result != 0) {
+            pid = -1;
+            stop();
+            return false;
+        }
+        return true;
+    }
+
+    void stop()
+    {
+        if (socket >= 0) {
+            send("quit");
+            ::close(socket);
+            socket = -1;
+        }
+        if (pid > 0) {
+            // Give the helper a moment to exit on its own before killing it. Once waitpid()
+            // has reaped it the pid may belong to another process already.
+            bool reaped = false;
+            for (int i = 0; i < 50 && !reaped; ++i) {
+                const pid_t result = waitpid(pid, nullptr, WNOHANG);
+                reaped = result == pid || (result < 0 && errno != EINTR);
+                if (!reaped)
+                    usleep(10000);
+            }
+            if (!reaped) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+            }
+            pid = -1;
+        }
+        unmap();
+        if (memfd >= 0) {
+            ::close(memfd);
+            memfd = -1;
+        }
+    }
+
+    bool send(const QByteArray &command)
+    {
+        const QByteArray line = command + '\n';
+        qint64 written = 0;
+        while (written < line.size()) {
+            const ssize_t n = ::send(socket, line.constData() + written, line.size() - written, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            written += n;
+        }
+        return true;
+    }
+
+    // While it waits, shouldAbort is polled and cancels the render when it says so
+    QByteArray readReply(ShouldAbortRenderCallback shouldAbort = nullptr, const QVariant &payload = QVariant())
+    {
+        QByteArray reply;
+        char c;
+        QElapsedTimer timer;
+        timer.start();
+        for (;;) {
+            pollfd pfd { socket, POLLIN, 0 };
+            const int ready = poll(&pfd, 1, shouldAbort ? abortPollInterval : replyTimeout);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready < 0)
+                return QByteArray();
+            if (ready == 0) {
+                if (timer.elapsed() >= replyTimeout)
+                    return QByteArray();
+                // The helper still answers, soon
+                if (shouldAbort && shouldAbort(payload)) {
+                    cancel();
+                    shouldAbort = nullptr;
+                }
+                continue;
+            }
+            const ssize_t n = ::read(socket, &c, 1);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return QByteArray();
+            if (c == '\n')
+                return reply;
+            reply += c;
+        }
+    }
+
+    bool open(const QString &filePath, const QByteArray &password)
+    {
+        return send("open " + QFile::encodeName(filePath).toHex() + ' ' + password.toHex())
+            && readReply().startsWith("ok");
+    }
+
+    // Sends a render command, the reply is collected by finishRender()
+    bool startRender(int pageNumber, float dpiX, float dpiY, const QRect &rect, int renderFlags)
+    {
+        const qint64 bytes = qint64(rect.width()) * rect.height() * 4 + controlBytes;
+        if (!reserve(bytes))
+            return false;
+        cancelFlag()->storeRelease(0);
+
+        QByteArray command("render");
+        command += ' ' + QByteArray::number(pageNumber);
+        command += ' ' + QByteArray::number(dpiX, 'g', 9);
+        command += ' ' + QByteArray::number(dpiY, 'g', 9);
+        command += ' ' + QByteArray::number(rect.x());
+        command += ' ' + QByteArray::number(rect.y());
+        command += ' ' + QByteArray::number(rect.width());
+        command += ' ' + QByteArray::number(rect.height());
+        command += ' ' + QByteArray::number(renderFlags);
+        command += ' ' + QByteArray::number(mapSize);
+        return send(command);
+    }
+
+    // Copies the rendered band into dest, which has bytesPerLine stride
+    Result finishRender(uchar *dest, int bytesPerLine, int width, int height,
+                        ShouldAbortRenderCallback shouldAbort, const QVariant &payload)
+    {
+        const QByteArray reply = readReply(shouldAbort, payload);
+        if (reply.startsWith("aborted"))
+            return Aborted;
+        if (!reply.startsWith("ok"))
+            return Failed;
+
+        const uchar *src = static_cast<const uchar*>(map);
+        for (int y = 0; y < height; ++y)
+            memcpy(dest + qint64(y) * bytesPerLine, src + qint64(y) * width * 4, width * 4);
+        return Done;
+    }
+
+    // Stops the render in progress, the helper answers "aborted" at its next step
+    void cancel()
+    {
+        if (map)
+            cancelFlag()->storeRelease(1);
+    }
+
+private:
+    QAtomicInt *cancelFlag()
+    {
+        return reinterpret_cast<QAtomicInt*>(static_cast<uchar*>(map) + mapSize - controlBytes);
+    }
+
+    bool reserve(qint64 bytes)
+    {
+        if (map && mapSize >= bytes)
+            return true;
+
+        unmap();
+        if (ftruncate(memfd, bytes) != 0)
+            return false;
+        map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            return false;
+        }
+        mapSize = bytes;
+        return true;
+    }
+
+    void unmap()
+    {
+        if (map) {
+            munmap(map, mapSize);
+            map = nullptr;
+            mapSize = 0;
+        }
+    }
+
+private:
+    pid_t pid {-1};
+    int socket {-1};
+    int memfd {-1};
+    void *map {nullptr};
+    qint64 mapSize {0};
+};
+
+#else
+
+// Helper processes rely on memfd_create() and posix_spawn(), the pool stays empty elsewhere
+class RenderWorker
+{
+};
+
+#endif
+
+
+RenderWorkerPool::RenderWorkerPool()
+{
+}
+
+RenderWorkerPool::~RenderWorkerPool()
+{
+    stop();
+}
+
+int RenderWorkerPool::configuredWorkerCount()
+{
+    return qBound(0, qEnvironmentVariableIntValue("OKULAR_PDFIUM_RENDER_PROCESSES"), 64);
+}
+
+QString RenderWorkerPool::workerExecutable()
+{
+    const QString path = qEnvironmentVariable("OKULAR_PDFIUM_RENDER_WORKER");
+    if (!path.isEmpty())
+        return path;
+#ifdef PDFIUM_RENDERWORKER_EXECUTABLE
+    return QStringLiteral(PDFIUM_RENDERWORKER_EXECUTABLE);
+#else
+    return QString();
+#endif
+}
+
+bool RenderWorkerPool::start(const QString &filePath, const QByteArray &password, int workerCount)
+{
+    QMutexLocker locker(&mutex);
+
+#ifdef Q_OS_LINUX
+    const QString executable = workerExecutable();
+    if (workerCount <= 0 || !QFileInfo(executable).isExecutable())
+        return false;
+
+    for (int i = 0; i < workerCount; ++i) {
+        RenderWorker *worker = new RenderWorker;
+        if (!worker->start(executable) || !worker->open(filePath, password)) {
+            qDebug() << "RenderWorkerPool: can't start" << executable;
+            delete worker;
+            break;
+        }
+        workers.append(worker);
+    }
+    return !workers.isEmpty();
+#else
+    Q_UNUSED(filePath)
+    Q_UNUSED(password)
+    Q_UNUSED(workerCount)
+    return false;
+#endif
+}
+
+void RenderWorkerPool::stop()
+{
+    QMutexLocker locker(&mutex);
+    qDeleteAll(workers);
+    workers.clear();
+}
+
+bool RenderWorkerPool::isRunning() const
+{
+    QMutexLocker locker(&mutex);
+    return !workers.isEmpty();
+}
+
+QImage RenderWorkerPool::render(int pageNumber, float dpiX, float dpiY, const QRect &rect, int renderFlags,
+                                PartialUpdateCallback partialUpdateCallback,
+                                ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback,
+                                ShouldAbortRenderCallback shouldAbortRenderCallback,
+                                const QVariant &payload)
+{
+    QMutexLocker locker(&mutex);
+
+#ifdef Q_OS_LINUX
+    if (workers.isEmpty() || rect.isEmpty())
+        return QImage();
+
+    // Don't bother splitting small images, a band per helper otherwise
+    const int bandCount = qBound(1, rect.height() / 64, workers.count());
+    const int bandHeight = (rect.height() + bandCount - 1) / bandCount;
+
+    QList<QRect> bands;
+    for (int y = rect.top(); y <= rect.bottom(); y += bandHeight)
+        bands.append(QRect(rect.left(), y, rect.width(), qMin(bandHeight, rect.bottom() + 1 - y)));
+
+    // Every helper gets its command before any reply is awaited, so the bands render concurrently
+    bool ok = true;
+    QVector<bool> started(bands.count(), false);
+    for (int i = 0; i < bands.count(); ++i) {
+        started[i] = workers.at(i)->startRender(pageNumber, dpiX, dpiY, bands.at(i), renderFlags);
+        ok = ok && started.at(i);
+    }
+
+    QImage img = AllocateRenderImage(rect.width(), rect.height());
+    ok = ok && !img.isNull();
+    // Pooled buffers hold old pixels, which partial updates would show
+    if (ok && partialUpdateCallback)
+        img.fill(Qt::white);
+
+    // Every started helper is waited for, even after a failure or an abort, so none is
+    // left with a reply pending
+    bool aborted = false;
+    for (int i = 0; i < bands.count(); ++i) {
+        if (!started.at(i))
+            continue;
+        if (aborted || img.isNull())
+            workers.at(i)->cancel();
+        const QRect &band = bands.at(i);
+        uchar *dest = img.isNull() ? nullptr : img.scanLine(band.top() - rect.top());
+        const RenderWorker::Result result = workers.at(i)->finishRender(dest, img.bytesPerLine(),
+                                                                         band.width(), dest ? band.height() : 0,
+                                                                         aborted ? nullptr : shouldAbortRenderCallback,
+                                                                         payload);
+        ok = ok && result != RenderWorker::Failed;
+        aborted = aborted || result == RenderWorker::Aborted;
+        if (result == RenderWorker::Done && !aborted && partialUpdateCallback && i + 1 < bands.count()
+            && shouldDoPartialUpdateCallback && shouldDoPartialUpdateCallback(payload)) {
+            partialUpdateCallback(img, payload);
+        }
+    }
+
+    if (ok && aborted)
+        return QImage();
+    if (!ok) {
+        // A helper died or timed out, go back to rendering in process
+        qDebug() << "RenderWorkerPool: render failed, stopping helper processes";
+        qDeleteAll(workers);
+        workers.clear();
+        return QImage();
+    }
+    return img;
+#else
+    Q_UNUSED(pageNumber)
+    Q_UNUSED(dpiX)
+    Q_UNUSED(dpiY)
+    Q_UNUSED(rect)
+    Q_UNUSED(renderFlags)
+    Q_UNUSED(partialUpdateCallback)
+    Q_UNUSED(shouldDoPartialUpdateCallback)
+    Q_UNUSED(shouldAbortRenderCallback)
+    Q_UNUSED(payload)
+    return QImage();
+#endif
+}
+
+}
@@ -0,0 +1,62 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_RENDER_WORKER_H
+#define QPDFIUM_RENDER_WORKER_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QRect>
+#include <QString>
+#include <QVariant>
+
+#include "page.h"
+
+namespace QPdfium {
+
+class RenderWorker;
+
+/*
+ * Pool of okular-pdfium-renderworker helper processes. Every helper has its
+ * own PDFium instance with the document opened, so renders dispatched to
+ * them run in parallel and outside of the generator's locks. Rendered bands
+ * come back through a shared memory buffer per helper, which also carries the
+ * flag that stops a helper when its request gets cancelled.
+ */
+class RenderWorkerPool
+{
+public:
+    RenderWorkerPool();
+    ~RenderWorkerPool();
+
+    bool start(const QString &filePath, const QByteArray &password, int workerCount);
+    void stop();
+    bool isRunning() const;
+
+    // Renders rect out of the page rendered at dpiX x dpiY, split in bands over the helpers.
+    // Partial updates are sent as bands arrive; an aborted render returns a null image.
+    QImage render(int pageNumber, float dpiX, float dpiY, const QRect &rect, int renderFlags,
+                  PartialUpdateCallback partialUpdateCallback = nullptr,
+                  ShouldDoPartialUpdateCallback shouldDoPartialUpdateCallback = nullptr,
+                  ShouldAbortRenderCallback shouldAbortRenderCallback = nullptr,
+                  const QVariant &payload = QVariant());
+
+    static int configuredWorkerCount();
+    static QString workerExecutable();
+
+private:
+    mutable QMutex mutex;
+    QList<RenderWorker*> workers;
+};
+
+}
+
+#endif // QPDFIUM_RENDER_WORKER_H
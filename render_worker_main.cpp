@@ -0,0 +1,168 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+/*
+ * okular-pdfium-renderworker: helper process of QPdfium::RenderWorkerPool.
+ *
+ * Reads one command per line on stdin and answers "ok" or "error" on stdout:
+ *   open <hex file path> <hex password>
+ *   render <page> <dpiX> <dpiY> <x> <y> <width> <height> <flags> <buffer size>
+ *   quit
+ * Renders land in the shared memory buffer passed on fd 3, 4 bytes per pixel,
+ * rows packed without padding. The last 64 bytes of the buffer hold a flag the
+ * generator sets to cancel the render in progress, which then answers "aborted".
+ */
+
+#include <pdfium/fpdfview.h>
+#include <pdfium/fpdf_progressive.h>
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QList>
+#include <QtGlobal>
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "font_info.h"
+
+static const int sharedMemoryFd = 3;
+static const qint64 controlBytes = 64;
+
+struct CancelPause : public IFSDK_PAUSE
+{
+    explicit CancelPause(QAtomicInt *cancel)
+      : cancel(cancel)
+    {
+        version = 1;
+        NeedToPauseNow = &CancelPause::needToPauseNow;
+        user = nullptr;
+    }
+
+    static FPDF_BOOL needToPauseNow(IFSDK_PAUSE *pThis)
+    {
+        return static_cast<CancelPause*>(pThis)->cancel->loadAcquire() != 0;
+    }
+
+    QAtomicInt *cancel;
+};
+
+static void reply(const char *answer)
+{
+    fputs(answer, stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    Q_UNUSED(argc)
+    Q_UNUSED(argv)
+
+    FPDF_LIBRARY_CONFIG config;
+    config.version = 2;
+    config.m_pUserFontPaths = nullptr;
+    config.m_pIsolate = nullptr;
+    config.m_v8EmbedderSlot = 0;
+    FPDF_InitLibraryWithConfig(&config);
+    if (FPDF_SYSFONTINFO *fontInfo = QPdfium::SystemFontInfo())
+        FPDF_SetSystemFontInfo(fontInfo);
+
+    FPDF_DOCUMENT pdfdoc = nullptr;
+    FPDF_PAGE pdfPage = nullptr;
+    int pdfPageNumber = -1;
+    void *map = nullptr;
+    qint64 mapSize = 0;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin)) {
+        const QList<QByteArray> args = QByteArray(line).trimmed().split(' ');
+        const QByteArray command = args.value(0);
+
+        if (command == "quit") {
+            break;
+        }
+        else if (command == "open" && args.count() >= 2 && !pdfdoc) {
+            const QByteArray filePath = QByteArray::fromHex(args.at(1));
+            const QByteArray password = QByteArray::fromHex(args.value(2));
+            pdfdoc = FPDF_LoadDocument(filePath.constData(), password.constData());
+            reply(pdfdoc ? "ok" : "error");
+        }
+        else if (command == "render" && args.count() == 10 && pdfdoc) {
+            const int pageNumber = args.at(1).toInt();
+            const float dpiX     = args.at(2).toFloat();
+            const float dpiY     = args.at(3).toFloat();
+            const int x          = args.at(4).toInt();
+            const int y          = args.at(5).toInt();
+            const int width      = args.at(6).toInt();
+            const int height     = args.at(7).toInt();
+            const int flags      = args.at(8).toInt();
+            const qint64 size    = args.at(9).toLongLong();
+
+            if (width <= 0 || height <= 0 || qint64(width) * height * 4 + controlBytes > size) {
+                reply("error");
+                continue;
+            }
+
+            if (size != mapSize) {
+                if (map)
+                    munmap(map, mapSize);
+                map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, sharedMemoryFd, 0);
+                if (map == MAP_FAILED) {
+                    map = nullptr;
+                    mapSize = 0;
+                    reply("error");
+                    continue;
+                }
+                mapSize = size;
+            }
+
+            if (pageNumber != pdfPageNumber) {
+                if (pdfPage)
+                    FPDF_ClosePage(pdfPage);
+                pdfPage = FPDF_LoadPage(pdfdoc, pageNumber);
+                pdfPageNumber = pdfPage ? pageNumber : -1;
+            }
+            if (!pdfPage) {
+                reply("error");
+                continue;
+            }
+
+            FPDF_BITMAP bitmap = FPDFBitmap_CreateEx(width, height, FPDFBitmap_BGRx, map, width * 4);
+            if (!bitmap) {
+                reply("error");
+                continue;
+            }
+            FPDFBitmap_FillRect(bitmap, 0, 0, width, height, 0xFFFFFFFF);
+            const int pageWidth  = qRound(FPDF_GetPageWidth(pdfPage) / 72.0 * dpiX);
+            const int pageHeight = qRound(FPDF_GetPageHeight(pdfPage) / 72.0 * dpiY);
+            QAtomicInt *cancel = reinterpret_cast<QAtomicInt*>(static_cast<uchar*>(map) + mapSize - controlBytes);
+            CancelPause pause(cancel);
+            int status = FPDF_RenderPageBitmap_Start(bitmap, pdfPage, -x, -y, pageWidth, pageHeight, 0, flags, &pause);
+            while (status == FPDF_RENDER_TOBECONTINUED && !cancel->loadAcquire())
+                status = FPDF_RenderPage_Continue(pdfPage, &pause);
+            FPDF_RenderPage_Close(pdfPage);
+            FPDFBitmap_Destroy(bitmap);
+            reply(status == FPDF_RENDER_DONE ? "ok" : cancel->loadAcquire() ? "aborted" : "error");
+        }
+        else {
+            reply("error");
+        }
+    }
+
+    if (map)
+        munmap(map, mapSize);
+    if (pdfPage)
+        FPDF_ClosePage(pdfPage);
+    if (pdfdoc)
+        FPDF_CloseDocument(pdfdoc);
+    FPDF_DestroyLibrary();
+    return 0;
+}
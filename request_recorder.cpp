@@ -0,0 +1,137 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QMutexLocker>
+
+#include "request_recorder.h"
+
+namespace QPdfium {
+
+RequestRecorder *RequestRecorder::create(const QString &filePath, int pagesCount)
+{
+    const QString directory = QFile::decodeName(qgetenv("OKULAR_PDFIUM_RECORD_DIR"));
+    if (directory.isEmpty() || !QDir().mkpath(directory))
+        return nullptr;
+
+    const QString name = QStringLiteral("%1-%2-%3.jsonl")
+                         .arg(QFileInfo(filePath).completeBaseName(),
+                              QDateTime::currentDateTime().toString(QStringLiteral("yyyyMMdd-hhmmss")))
+                         .arg(QCoreApplication::applicationPid());
+    RequestRecorder *recorder = new RequestRecorder(QDir(directory).filePath(name));
+    if (!recorder->trace.isOpen()) {
+        qDebug() << "QPdfium::RequestRecorder: can't write" << recorder->trace.fileName();
+        delete recorder;
+        return nullptr;
+    }
+
+    QJsonObject event;
+    event[QStringLiteral("event")] = QStringLiteral("open");
+    event[QStringLiteral("file")] = QFileInfo(filePath).absoluteFilePath();
+    event[QStringLiteral("pages")] = pagesCount;
+    recorder->write(event);
+    qDebug() << "QPdfium::RequestRecorder: recording to" << recorder->trace.fileName();
+    return recorder;
+}
+
+RequestRecorder::RequestRecorder(const QString &traceFilePath)
+  : trace(traceFilePath)
+{
+    trace.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    clock.start();
+}
+
+RequestRecorder::~RequestRecorder()
+{
+    QJsonObject event;
+    event[QStringLiteral("event")] = QStringLiteral("close");
+    QMutexLocker locker(&mutex);
+    write(event);
+}
+
+QString RequestRecorder::traceFilePath() const
+{
+    return trace.fileName();
+}
+
+quint64 RequestRecorder::pixmapStarted(const RecordedPixmap &pixmap)
+{
+    QJsonObject event;
+    event[QStringLiteral("event")] = QStringLiteral("pixmap");
+    event[QStringLiteral("page")] = pixmap.pageNumber;
+    event[QStringLiteral("width")] = pixmap.width;
+    event[QStringLiteral("height")] = pixmap.height;
+    event[QStringLiteral("tile")] = pixmap.tile;
+    if (pixmap.tile) {
+        event[QStringLiteral("rect")] = QJsonArray({ pixmap.rect.left(), pixmap.rect.top(),
+                                                     pixmap.rect.right(), pixmap.rect.bottom() });
+    }
+    event[QStringLiteral("priority")] = pixmap.priority;
+    event[QStringLiteral("preload")] = pixmap.preload;
+    event[QStringLiteral("asynchronous")] = pixmap.asynchronous;
+    event[QStringLiteral("partial")] = pixmap.partialUpdates;
+    return started(event);
+}
+
+void RequestRecorder::pixmapFinished(quint64 id, bool aborted)
+{
+    QJsonObject event;
+    event[QStringLiteral("event")] = aborted ? QStringLiteral("abort") : QStringLiteral("pixmap_done");
+    finished(id, event);
+}
+
+quint64 RequestRecorder::textStarted(int pageNumber)
+{
+    QJsonObject event;
+    event[QStringLiteral("event")] = QStringLiteral("text");
+    event[QStringLiteral("page")] = pageNumber;
+    return started(event);
+}
+
+void RequestRecorder::textFinished(quint64 id)
+{
+    QJsonObject event;
+    event[QStringLiteral("event")] = QStringLiteral("text_done");
+    finished(id, event);
+}
+
+quint64 RequestRecorder::started(QJsonObject &event)
+{
+    QMutexLocker locker(&mutex);
+    const quint64 id = nextId++;
+    event[QStringLiteral("id")] = double(id);
+    startTimes.insert(id, clock.nsecsElapsed());
+    write(event);
+    return id;
+}
+
+void RequestRecorder::finished(quint64 id, QJsonObject &event)
+{
+    QMutexLocker locker(&mutex);
+    event[QStringLiteral("id")] = double(id);
+    event[QStringLiteral("ms")] = (clock.nsecsElapsed() - startTimes.take(id)) / 1e6;
+    write(event);
+}
+
+// Called with the mutex held. Flushed line by line so a trace survives a crash or a kill.
+void RequestRecorder::write(QJsonObject &event)
+{
+    event[QStringLiteral("t")] = clock.nsecsElapsed() / 1e6;
+    trace.write(QJsonDocument(event).toJson(QJsonDocument::Compact));
+    trace.write("\n");
+    trace.flush();
+}
+
+}
@@ -0,0 +1,73 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_REQUEST_RECORDER_H
+#define QPDFIUM_REQUEST_RECORDER_H
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QJsonObject>
+#include <QMutex>
+#include <QRectF>
+#include <QString>
+
+namespace QPdfium {
+
+// A pixmap request as Okular handed it to the generator
+struct RecordedPixmap
+{
+    int pageNumber {-1};
+    int width {0};
+    int height {0};
+    bool tile {false};
+    QRectF rect;                // normalized, only for tiles
+    int priority {0};
+    bool preload {false};
+    bool asynchronous {false};
+    bool partialUpdates {false};
+};
+
+/*
+ * Writes the requests Okular makes for a document to a trace, one JSON object
+ * per line with the milliseconds since the document was opened. Enabled by
+ * setting OKULAR_PDFIUM_RECORD_DIR, pdfium-backend-replay plays traces back.
+ */
+class RequestRecorder
+{
+public:
+    // nullptr when recording is off or the trace can't be written
+    static RequestRecorder *create(const QString &filePath, int pagesCount);
+    ~RequestRecorder();
+
+    QString traceFilePath() const;
+
+    // The ids tie the end of a request to its start
+    quint64 pixmapStarted(const RecordedPixmap &pixmap);
+    void pixmapFinished(quint64 id, bool aborted);
+    quint64 textStarted(int pageNumber);
+    void textFinished(quint64 id);
+
+private:
+    explicit RequestRecorder(const QString &traceFilePath);
+    quint64 started(QJsonObject &event);
+    void finished(quint64 id, QJsonObject &event);
+    void write(QJsonObject &event);
+
+private:
+    QMutex mutex;
+    QFile trace;
+    QElapsedTimer clock;
+    quint64 nextId {1};
+    QHash<quint64, qint64> startTimes;  // nanoseconds of the requests in progress
+};
+
+}
+
+#endif // QPDFIUM_REQUEST_RECORDER_H
@@ -0,0 +1,336 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <cstring>
+
+#include "text_cache.h"
+
+namespace QPdfium {
+
+// Bump when the file layout below changes, older files are then ignored
+static const quint32 textCacheVersion = 1;
+static const char textCacheMagic[4] = { 'O', 'P', 'T', 'C' };
+
+// File layout, in host byte order:
+//   FileHeader
+//   quint32 unicode[charCount]
+//   float   boxes[charCount * 4]
+//   LinkRecord + UTF-8 uri bytes, linkCount times
+struct FileHeader
+{
+    char magic[4];
+    quint32 version;
+    qint32 orientation;
+    quint32 charCount;
+    quint32 linkCount;
+};
+
+struct LinkRecord
+{
+    float boundary[4];      // left, top, right, bottom, normalized
+    qint32 targetPage;
+    qint32 hasTargetPosition;
+    float targetPosition[2];
+    quint32 uriLength;
+};
+
+// Hashes the size, the modification time and samples spread over the file: a full hash
+// of a multi-hundred MB file would cost more than the text extraction the cache saves.
+// The time catches edits that keep the size and miss the samples.
+static QByteArray documentKey(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    const qint64 size = file.size();
+    const qint64 sampleSize = 64 * 1024;
+    const int samples = 16;
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArray::number(size));
+    hash.addData(QByteArray::number(QFileInfo(file).lastModified().toMSecsSinceEpoch()));
+    for (int i = 0; i <= samples; ++i) {
+        const qint64 offset = qMax(qint64(0), qMin(size - sampleSize, size / samples * i));
+        if (!file.seek(offset))
+            return QByteArray();
+        hash.addData(file.read(sampleSize));
+    }
+    return hash.result().toHex();
+}
+
+// Hashes the document for its cache directory, then checks the size of the whole cache
+class DocumentKeyJob : public QRunnable
+{
+public:
+    explicit DocumentKeyJob(TextCache *cache)
+      : cache(cache)
+    {
+    }
+
+    void run() override
+    {
+        const QByteArray key = documentKey(cache->filePath);
+        {
+            QMutexLocker locker(&cache->mutex);
+            if (!key.isEmpty())
+                cache->documentDirectory = TextCache::cacheDirectory() + QLatin1Char('/') + QString::fromLatin1(key);
+            cache->keyReady = true;
+            cache->keyDone.wakeAll();
+        }
+        // The cache may be gone from here on
+        TextCache::trim();
+    }
+
+private:
+    TextCache *cache;
+};
+
+class TrimJob : public QRunnable
+{
+public:
+    void run() override
+    {
+        TextCache::trim();
+    }
+};
+
+TextCache::TextCache(const QString &filePath)
+  : filePath(filePath)
+  , enabled(maxBytes() > 0)
+{
+    if (enabled)
+        QThreadPool::globalInstance()->start(new DocumentKeyJob(this));
+    else
+        keyReady = true;
+}
+
+TextCache::~TextCache()
+{
+    QMutexLocker locker(&mutex);
+    while (!keyReady)
+        keyDone.wait(&mutex);
+}
+
+qint64 TextCache::maxBytes()
+{
+    bool ok = false;
+    const int megabytes = qEnvironmentVariableIntValue("OKULAR_PDFIUM_TEXT_CACHE_MB", &ok);
+    return (ok && megabytes >= 0) ? qint64(megabytes) * 1024 * 1024 : 256 * 1024 * 1024;
+}
+
+QString TextCache::cacheDirectory()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+           + QStringLiteral("/okular-pdfium/text");
+}
+
+bool TextCache::isEnabled() const
+{
+    return enabled;
+}
+
+bool TextCache::isReady()
+{
+    QMutexLocker locker(&mutex);
+    return keyReady;
+}
+
+QString TextCache::pageFilePath(int pageNumber)
+{
+    while (!keyReady)
+        keyDone.wait(&mutex);
+    if (documentDirectory.isEmpty())
+        return QString();
+    return documentDirectory + QLatin1Char('/') + QString::number(pageNumber);
+}
+
+bool TextCache::load(int pageNumber, PageTextData *data)
+{
+    QMutexLocker locker(&mutex);
+    if (!enabled)
+        return false;
+
+    const QString path = pageFilePath(pageNumber);
+    QFile file(path);
+    if (path.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+        ++missesCount;
+        return false;
+    }
+
+    const qint64 size = file.size();
+    const uchar *map = size >= qint64(sizeof(FileHeader)) ? file.map(0, size) : nullptr;
+    if (!map) {
+        ++missesCount;
+        return false;
+    }
+
+    bool valid = false;
+    FileHeader header;
+    memcpy(&header, map, sizeof(header));
+    qint64 pos = sizeof(header);
+    const qint64 textBytes = qint64(header.charCount) * (sizeof(quint32) + 4 * sizeof(float));
+
+    if (memcmp(header.magic, textCacheMagic, 4) == 0 && header.version == textCacheVersion
+        && pos + textBytes <= size) {
+        data->orientation = static_cast<Okular::Rotation>(header.orientation);
+        data->layout.unicode.resize(header.charCount);
+        data->layout.boxes.resize(header.charCount * 4);
+        memcpy(data->layout.unicode.data(), map + pos, header.charCount * sizeof(quint32));
+        pos += header.charCount * sizeof(quint32);
+        memcpy(data->layout.boxes.data(), map + pos, header.charCount * 4 * sizeof(float));
+        pos += header.charCount * 4 * sizeof(float);
+
+        valid = true;
+        data->links.clear();
+        for (quint32 i = 0; i < header.linkCount; ++i) {
+            LinkRecord record;
+            if (pos + qint64(sizeof(record)) > size) {
+                valid = false;
+                break;
+            }
+            memcpy(&record, map + pos, sizeof(record));
+            pos += sizeof(record);
+            if (pos + record.uriLength > size) {
+                valid = false;
+                break;
+            }
+
+            LinkEntity link;
+            link.boundary = QRectF(QPointF(record.boundary[0], record.boundary[1]),
+                                   QPointF(record.boundary[2], record.boundary[3]));
+            link.targetPage = record.targetPage;
+            if (record.hasTargetPosition)
+                link.targetPosition = QPointF(record.targetPosition[0], record.targetPosition[1]);
+            if (record.uriLength)
+                link.uri = QString::fromUtf8(reinterpret_cast<const char*>(map + pos), int(record.uriLength));
+            pos += record.uriLength;
+            data->links.append(link);
+        }
+    }
+    file.unmap(const_cast<uchar*>(map));
+
+    if (!valid) {
+        ++missesCount;
+        return false;
+    }
+
+    // Keeps the file at the recent end of the cache
+    file.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+    ++hitsCount;
+    return true;
+}
+
+void TextCache::store(int pageNumber, const PageTextData &data)
+{
+    QMutexLocker locker(&mutex);
+    const QString path = enabled ? pageFilePath(pageNumber) : QString();
+    if (!enabled || path.isEmpty() || !QDir().mkpath(documentDirectory))
+        return;
+
+    QByteArray bytes;
+    FileHeader header;
+    memcpy(header.magic, textCacheMagic, 4);
+    header.version = textCacheVersion;
+    header.orientation = data.orientation;
+    header.charCount = data.layout.unicode.count();
+    header.linkCount = data.links.count();
+    bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    bytes.append(reinterpret_cast<const char*>(data.layout.unicode.constData()), header.charCount * sizeof(quint32));
+    bytes.append(reinterpret_cast<const char*>(data.layout.boxes.constData()), header.charCount * 4 * sizeof(float));
+
+    foreach (const LinkEntity &link, data.links) {
+        const QByteArray uri = link.uri.toUtf8();
+        LinkRecord record;
+        record.boundary[0] = link.boundary.left();
+        record.boundary[1] = link.boundary.top();
+        record.boundary[2] = link.boundary.right();
+        record.boundary[3] = link.boundary.bottom();
+        record.targetPage = link.targetPage;
+        record.hasTargetPosition = !link.targetPosition.isNull();
+        record.targetPosition[0] = link.targetPosition.x();
+        record.targetPosition[1] = link.targetPosition.y();
+        record.uriLength = uri.size();
+        bytes.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        bytes.append(uri);
+    }
+
+    QSaveFile file(path);
+    if (file.open(QIODevice::WriteOnly) && file.write(bytes) == bytes.size() && file.commit()) {
+        bytesStored += bytes.size();
+        // Don't let a long session grow the cache unchecked either
+        if (bytesStored > maxBytes() / 8) {
+            bytesStored = 0;
+            trimLater();
+        }
+    }
+}
+
+quint64 TextCache::hits() const
+{
+    return hitsCount.loadAcquire();
+}
+
+quint64 TextCache::misses() const
+{
+    return missesCount.loadAcquire();
+}
+
+void TextCache::trimLater()
+{
+    QThreadPool::globalInstance()->start(new TrimJob);
+}
+
+void TextCache::trim()
+{
+    struct Entry {
+        QString path;
+        qint64 size;
+        QDateTime modified;
+    };
+
+    QVector<Entry> entries;
+    qint64 total = 0;
+    QDirIterator it(cacheDirectory(), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        entries.append({ info.filePath(), info.size(), info.lastModified() });
+        total += info.size();
+    }
+
+    const qint64 cap = maxBytes();
+    if (total <= cap)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.modified < b.modified;
+    });
+    for (const Entry &entry : qAsConst(entries)) {
+        if (total <= cap)
+            break;
+        if (QFile::remove(entry.path))
+            total -= entry.size;
+    }
+}
+
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_TEXT_CACHE_H
+#define QPDFIUM_TEXT_CACHE_H
+
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <okular/core/global.h>
+
+#include "page.h"
+
+namespace QPdfium {
+
+// What the text cache keeps of a page
+struct PageTextData
+{
+    TextLayout layout;
+    QVector<LinkEntity> links;
+    Okular::Rotation orientation {Okular::Rotation0};
+};
+
+/*
+ * Text layout, links and orientation of the pages of a document, kept on disk
+ * under the user's cache directory so reopening a document doesn't extract its
+ * text again. Entries are keyed by a hash of the document's content and
+ * modification time and the page number, one file per page in a fixed binary layout that is read through
+ * a memory map. The whole cache is capped in size, least recently used files
+ * are removed first. Hashing the document and trimming the cache happen in
+ * the global thread pool, not in the thread that opens or renders.
+ *
+ * OKULAR_PDFIUM_TEXT_CACHE_MB sets the cap, 0 disables the cache.
+ */
+class TextCache
+{
+public:
+    explicit TextCache(const QString &filePath);
+    ~TextCache();
+
+    bool isEnabled() const;
+    // False until the document is hashed, load() and store() wait for it
+    bool isReady();
+    bool load(int pageNumber, PageTextData *data);
+    void store(int pageNumber, const PageTextData &data);
+
+    quint64 hits() const;
+    quint64 misses() const;
+
+    static qint64 maxBytes();
+    static QString cacheDirectory();
+
+private:
+    friend class DocumentKeyJob;
+    friend class TrimJob;
+
+    // Called with the mutex held
+    QString pageFilePath(int pageNumber);
+    static void trim();
+    static void trimLater();
+
+private:
+    QString filePath;
+    QMutex mutex;
+    QWaitCondition keyDone;
+    bool keyReady {false};
+    QString documentDirectory;     // empty when the document couldn't be hashed
+    bool enabled;
+    qint64 bytesStored {0};
+    QAtomicInteger<quint64> hitsCount {0};
+    QAtomicInteger<quint64> missesCount {0};
+};
+
+}
+
+#endif // QPDFIUM_TEXT_CACHE_H
@@ -0,0 +1,150 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGlobalStatic>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QVector>
+
+#include <atomic>
+
+#include "trace.h"
+
+namespace QPdfium {
+
+const bool Trace::enabled = !qgetenv("OKULAR_PDFIUM_TRACE").isEmpty();
+
+// The most recent spans, enough for a few minutes of scrolling
+static const int ringSize = 1 << 16;
+
+struct TraceEntry
+{
+    QAtomicPointer<const char> name;    // set last, null while the entry is written
+    QAtomicInteger<quint64> index;      // of the span in the ring, tells reused entries apart
+    qint64 start;
+    qint64 duration;
+    int page;
+    int thread;
+};
+
+class TraceRing
+{
+public:
+    TraceRing()
+      : entries(ringSize)
+    {
+        clock.start();
+    }
+
+    ~TraceRing()
+    {
+        dump();
+    }
+
+    void record(const char *name, qint64 start, qint64 end, int page)
+    {
+        static QAtomicInteger<int> threadCount;
+        thread_local const int thread = ++threadCount;
+
+        const quint64 index = next.fetchAndAddRelaxed(1);
+        TraceEntry &entry = entries[int(index % ringSize)];
+        entry.name.storeRelease(nullptr);
+        // Keeps the writes below from being seen before the name is cleared
+        std::atomic_thread_fence(std::memory_order_release);
+        entry.index.storeRelease(index);
+        entry.start = start;
+        entry.duration = end - start;
+        entry.page = page;
+        entry.thread = thread;
+        entry.name.storeRelease(name);
+    }
+
+    void dump()
+    {
+        QMutexLocker locker(&dumpMutex);
+        const quint64 written = next.loadAcquire();
+        const quint64 first = written > quint64(ringSize) ? written - ringSize : 0;
+        const qint64 pid = QCoreApplication::applicationPid();
+
+        QJsonArray events;
+        for (quint64 i = first; i < written; ++i) {
+            const TraceEntry &entry = entries.at(int(i % ringSize));
+            const char *name = entry.name.loadAcquire();
+            if (!name || entry.index.loadAcquire() != i)
+                continue;
+            const qint64 start = entry.start;
+            const qint64 duration = entry.duration;
+            const int page = entry.page;
+            const int thread = entry.thread;
+            // Like a seqlock: an entry rewritten while it was copied has its name cleared
+            // or its index changed by now, the copy is dropped then
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (entry.name.loadAcquire() != name || entry.index.loadAcquire() != i)
+                continue;
+            QJsonObject event;
+            event[QStringLiteral("name")] = QLatin1String(name);
+            event[QStringLiteral("ph")] = QStringLiteral("X");
+            event[QStringLiteral("ts")] = start / 1000.0;
+            event[QStringLiteral("dur")] = duration / 1000.0;
+            event[QStringLiteral("pid")] = pid;
+            event[QStringLiteral("tid")] = thread;
+            if (page >= 0)
+                event[QStringLiteral("args")] = QJsonObject{{ QStringLiteral("page"), page }};
+            events.append(event);
+        }
+
+        QJsonObject trace;
+        trace[QStringLiteral("traceEvents")] = events;
+        trace[QStringLiteral("displayTimeUnit")] = QStringLiteral("ms");
+
+        QFile file(QFile::decodeName(qgetenv("OKULAR_PDFIUM_TRACE")));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qDebug() << "QPdfium::Trace: can't write" << file.fileName();
+            return;
+        }
+        file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact));
+        qDebug() << "QPdfium::Trace:" << events.count() << "spans written to" << file.fileName();
+    }
+
+    QElapsedTimer clock;
+
+private:
+    QVector<TraceEntry> entries;
+    QAtomicInteger<quint64> next;
+    QMutex dumpMutex;
+};
+
+Q_GLOBAL_STATIC(TraceRing, traceRing)
+
+qint64 Trace::now()
+{
+    return traceRing->clock.nsecsElapsed();
+}
+
+void Trace::record(const char *name, qint64 start, qint64 end, int page)
+{
+    traceRing->record(name, start, end, page);
+}
+
+void Trace::dump()
+{
+    if (enabled)
+        traceRing->dump();
+}
+
+}
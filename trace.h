@@ -0,0 +1,67 @@
+/***************************************************************************
+ *   Copyright (C) 2019-2020 by Thanomsub Noppaburana <donga.nb@gmail.com> *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QPDFIUM_TRACE_H
+#define QPDFIUM_TRACE_H
+
+#include <QtGlobal>
+
+namespace QPdfium {
+
+/*
+ * Timed spans of the backend, kept in a ring buffer of the most recent ones and
+ * written as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) to the file
+ * OKULAR_PDFIUM_TRACE names, when a document is closed and at exit. Without
+ * that variable a span costs a test of a constant.
+ */
+class Trace
+{
+public:
+    static const bool enabled;
+
+    static qint64 now();
+    // name must outlive the process, e.g. a string literal
+    static void record(const char *name, qint64 start, qint64 end, int page);
+    // Writes the spans in the ring, the oldest first
+    static void dump();
+};
+
+// Records the time from its construction to end() or its destruction
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *spanName, int page = -1)
+      : name(Trace::enabled ? spanName : nullptr), page(page), start(name ? Trace::now() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        end();
+    }
+
+    void end()
+    {
+        if (name) {
+            Trace::record(name, start, Trace::now(), page);
+            name = nullptr;
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(TraceSpan)
+
+    const char *name;
+    int page;
+    qint64 start;
+};
+
+}
+
+#endif // QPDFIUM_TRACE_H